@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+
+namespace Shapez {
+
+// Memory of the big search tables, backed by huge pages to reduce the TLB
+// misses of random probes. Large blocks are mapped directly: 1 GB pages for
+// multiples of 1 GB, then 2 MB pages, and ordinary pages advised for
+// transparent huge pages when no huge pages are reserved. Small blocks
+// (deque nodes, small tables) are carved from 2 MB chunks, with a free list
+// per size.
+class HugePageArena {
+public:
+    static constexpr size_t hugePage = size_t(1) << 21;
+    static constexpr size_t gigaPage = size_t(1) << 30;
+    // blocks from this size are mapped directly
+    static constexpr size_t largeSize = size_t(1) << 16;
+    static constexpr size_t align = 16;
+
+    // Whether huge pages are tried. Only affects new mappings, so it can be
+    // changed at any time.
+    static inline std::atomic<bool> enabled = true;
+    // bytes mapped with each kind of pages
+    static inline std::atomic<size_t> gigaBytes = 0;
+    static inline std::atomic<size_t> hugeBytes = 0;
+    static inline std::atomic<size_t> advisedBytes = 0;
+
+    static HugePageArena& instance() {
+        static HugePageArena arena;
+        return arena;
+    }
+
+    void* allocate(size_t bytes) {
+        if (bytes >= largeSize) {
+            return map(roundUp(bytes, hugePage));
+        }
+        size_t size = roundUp(std::max<size_t>(bytes, 1), align);
+        std::lock_guard lock{mutex};
+        auto& list = freeLists[size / align];
+        if (!list.empty()) {
+            void* ret = list.back();
+            list.pop_back();
+            return ret;
+        }
+        if (chunkLeft < size) {
+            chunk = static_cast<char*>(map(hugePage));
+            chunkLeft = hugePage;
+        }
+        void* ret = chunk;
+        chunk += size;
+        chunkLeft -= size;
+        return ret;
+    }
+
+    void deallocate(void* p, size_t bytes) {
+        if (bytes >= largeSize) {
+            munmap(p, roundUp(bytes, hugePage));
+            return;
+        }
+        size_t size = roundUp(std::max<size_t>(bytes, 1), align);
+        std::lock_guard lock{mutex};
+        freeLists[size / align].push_back(p);
+    }
+
+    // Bytes of the process actually backed by transparent huge pages
+    static size_t transparentBytes() {
+        std::ifstream file{"/proc/self/smaps_rollup"};
+        std::string key;
+        size_t kb = 0;
+        while (file >> key) {
+            if (key == "AnonHugePages:" && file >> kb) {
+                return kb * 1024;
+            }
+        }
+        return 0;
+    }
+
+private:
+    HugePageArena() : freeLists(largeSize / align) {}
+
+    static constexpr size_t roundUp(size_t bytes, size_t unit) {
+        return (bytes + unit - 1) / unit * unit;
+    }
+
+    // `bytes` is a multiple of `hugePage`
+    static void* map(size_t bytes) {
+        constexpr int prot = PROT_READ | PROT_WRITE;
+        constexpr int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        if (enabled) {
+            if (bytes % gigaPage == 0) {
+                void* p = mmap(nullptr, bytes, prot,
+                               flags | MAP_HUGETLB | (30 << MAP_HUGE_SHIFT),
+                               -1, 0);
+                if (p != MAP_FAILED) {
+                    gigaBytes += bytes;
+                    return p;
+                }
+            }
+            void* p = mmap(nullptr, bytes, prot,
+                           flags | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT),
+                           -1, 0);
+            if (p != MAP_FAILED) {
+                hugeBytes += bytes;
+                return p;
+            }
+        }
+        // Map one more huge page, so the block can start at a huge page
+        // boundary, which transparent huge pages need
+        size_t padded = bytes + (enabled ? hugePage : 0);
+        void* p = mmap(nullptr, padded, prot, flags, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        char* begin = static_cast<char*>(p);
+        if (enabled) {
+            char* aligned = reinterpret_cast<char*>(roundUp(
+                    reinterpret_cast<uintptr_t>(begin), hugePage));
+            if (aligned > begin) {
+                munmap(begin, aligned - begin);
+            }
+            char* end = aligned + bytes;
+            if (begin + padded > end) {
+                munmap(end, begin + padded - end);
+            }
+            begin = aligned;
+            if (madvise(begin, bytes, MADV_HUGEPAGE) == 0) {
+                advisedBytes += bytes;
+            }
+        }
+        return begin;
+    }
+
+    std::mutex mutex;
+    // free blocks of small sizes, indexed by size / align
+    std::vector<std::vector<void*>> freeLists;
+    char* chunk = nullptr;
+    size_t chunkLeft = 0;
+};
+
+// Allocator for the containers of the searcher, backed by `HugePageArena`
+template <typename T>
+struct HugePageAllocator {
+    using value_type = T;
+
+    HugePageAllocator() = default;
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(
+                HugePageArena::instance().allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        HugePageArena::instance().deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const HugePageAllocator<U>&) const {
+        return true;
+    }
+};
+
+}
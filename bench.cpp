@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "3ps/ska/bytell_hash_map.hpp"
+
+#include "shapez.hpp"
+
+namespace Shapez {
+
+// Micro-benchmarks of the shape operations that the search spends its time
+// in. Each operation runs over the same sample of shapes, so the branches
+// and the collapse loops see a realistic mix of shapes.
+struct Bench {
+    using T = Shape::T;
+    constexpr static size_t PART = Shape::PART;
+    constexpr static size_t LAYER = Shape::LAYER;
+
+    static constexpr size_t sampleSize = 1 << 16;
+
+    std::vector<Shape> sample;
+    // the pieces stacked by the search
+    std::vector<Shape> pieces;
+    size_t trials = 5;
+    // operations per trial, at least
+    size_t minOps = 1 << 24;
+
+    struct Result {
+        std::string name;
+        double nsPerOp;
+        size_t ops;
+    };
+
+    Bench() {
+        for (size_t part = 0; part < PART; ++part) {
+            Shape pin;
+            pin.set(LAYER - 1, part, Type::Pin);
+            pieces.push_back(pin);
+        }
+        for (size_t len = 1; len <= PART; ++len) {
+            Shape shape;
+            for (size_t part = 0; part < len; ++part) {
+                shape.set(LAYER - 1, part, Type::Shape);
+            }
+            for (size_t part = 0; part < PART; ++part) {
+                pieces.push_back(shape.rotate(part));
+            }
+        }
+    }
+
+    // A uniform sample of the shapes and halves of a dump
+    void sampleDump(const std::string& filename) {
+        ShapeSet set = ShapeSet::load(filename);
+        std::vector<Shape> all = std::move(set.shapes);
+        all.insert(all.end(), set.halves.begin(), set.halves.end());
+        std::mt19937_64 rng{1};
+        std::sample(all.begin(), all.end(), std::back_inserter(sample),
+                    sampleSize, rng);
+        std::shuffle(sample.begin(), sample.end(), rng);
+    }
+
+    // Without a dump, take the shapes in the BFS order of a search from the
+    // empty shape, which visits the small shapes first
+    void sampleSearch() {
+        ska::bytell_hash_set<Shape> seen{Shape()};
+        std::deque<Shape> queue{Shape()};
+        while (!queue.empty() && sample.size() < sampleSize) {
+            Shape shape = queue.front();
+            queue.pop_front();
+            sample.push_back(shape);
+            auto visit = [&](Shape next) {
+                next = next.canonical();
+                if (seen.insert(next).second) {
+                    queue.push_back(next);
+                }
+            };
+            for (Shape piece : pieces) {
+                visit(shape.stack(piece));
+            }
+            visit(shape.pin());
+            visit(shape.crystalize());
+            visit(shape.cut());
+        }
+        std::mt19937_64 rng{1};
+        std::shuffle(sample.begin(), sample.end(), rng);
+    }
+
+    // The fastest of the trials, in ns per operation. The results are
+    // folded into a sink, so the compiler can't drop the operation.
+    template <typename F>
+    Result run(std::string name, F&& f) const {
+        size_t rounds = std::max<size_t>(1, minOps / sample.size());
+        double best = 0;
+        for (size_t trial = 0; trial < trials; ++trial) {
+            T sink = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t round = 0; round < rounds; ++round) {
+                for (size_t i = 0; i < sample.size(); ++i) {
+                    sink ^= f(sample[i], i);
+                }
+                asm volatile("" : "+r"(sink));
+            }
+            std::chrono::duration<double, std::nano> elapsed =
+                std::chrono::steady_clock::now() - start;
+            double ns = elapsed.count() / (rounds * sample.size());
+            best = trial == 0 ? ns : std::min(best, ns);
+        }
+        return {std::move(name), best, rounds * sample.size()};
+    }
+
+    std::vector<Result> runAll() const {
+        std::vector<Result> ret;
+        ret.push_back(run("rotate", [](Shape s, size_t) {
+            return s.rotate(1).value;
+        }));
+        ret.push_back(run("flip", [](Shape s, size_t) {
+            return s.flip().value;
+        }));
+        ret.push_back(run("find", [](Shape s, size_t) {
+            return s.find<Type::Empty>();
+        }));
+        ret.push_back(run("supportedPart", [](Shape s, size_t) {
+            return s.supportedPart();
+        }));
+        ret.push_back(run("collapse", [](Shape s, size_t) {
+            return s.collapse().value;
+        }));
+        ret.push_back(run("cut", [](Shape s, size_t) {
+            return s.cut().value;
+        }));
+        ret.push_back(run("pin", [](Shape s, size_t) {
+            return s.pin().value;
+        }));
+        ret.push_back(run("crystalize", [](Shape s, size_t) {
+            return s.crystalize().value;
+        }));
+        ret.push_back(run("stack", [&](Shape s, size_t i) {
+            return s.stack(pieces[i % pieces.size()]).value;
+        }));
+        ret.push_back(run("normalize", [](Shape s, size_t) {
+            return s.normalize().value;
+        }));
+        ret.push_back(run("canonical", [](Shape s, size_t) {
+            return s.canonical().value;
+        }));
+        ret.push_back(run("canonicalHalf", [](Shape s, size_t) {
+            return s.canonicalHalf().value;
+        }));
+        return ret;
+    }
+};
+
+}
+
+int main(int argc, char* argv[]) {
+    using namespace Shapez;
+
+    Bench bench;
+    bool json = false;
+    std::string dump;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--json") {
+            json = true;
+        } else if (arg == "--trials" && i + 1 < argc) {
+            bench.trials = std::max(1ul, std::stoul(argv[++i]));
+        } else if (arg == "--ops" && i + 1 < argc) {
+            bench.minOps = std::stoul(argv[++i]);
+        } else if (!arg.starts_with("--") && dump.empty()) {
+            dump = arg;
+        } else {
+            std::cout << "Usage: bench [--json] [--trials n] [--ops n] "
+                "[dump.bin]" << std::endl;
+            return 1;
+        }
+    }
+    if (dump.empty()) {
+        bench.sampleSearch();
+    } else {
+        bench.sampleDump(dump);
+    }
+    if (bench.sample.empty()) {
+        std::cout << "No shapes to sample" << std::endl;
+        return 1;
+    }
+
+    auto results = bench.runAll();
+    std::string source = dump.empty() ? "search" : "dump";
+    if (json) {
+        std::cout << std::format("{{\"layers\": {}, \"parts\": {}, "
+                "\"sample\": {}, \"source\": \"{}\", \"results\": [",
+                Shape::LAYER, Shape::PART, bench.sample.size(), source);
+        for (size_t i = 0; i < results.size(); ++i) {
+            std::cout << std::format("{}{{\"op\": \"{}\", \"ns_per_op\": "
+                    "{:.3f}, \"ops\": {}}}", i ? ", " : "", results[i].name,
+                    results[i].nsPerOp, results[i].ops);
+        }
+        std::cout << "]}" << std::endl;
+    } else {
+        std::cout << "op,layers,parts,ns_per_op,ops" << std::endl;
+        for (const auto& result : results) {
+            std::cout << std::format("{},{},{},{:.3f},{}", result.name,
+                    Shape::LAYER, Shape::PART, result.nsPerOp, result.ops)
+                << std::endl;
+        }
+    }
+    return 0;
+}
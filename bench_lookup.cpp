@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "index.hpp"
+#include "shapez.hpp"
+
+namespace Shapez {
+
+// Latency and throughput of the creatable check of lookup.cpp, with the
+// halves and the shapes of a dump in each of the index layouts of
+// index.hpp. The queries come in three mixes, since they don't take the
+// same path: shapes made of two known halves, shapes only known whole, and
+// shapes that can't be made. Each query is randomly rotated and flipped.
+struct LookupBench {
+    using T = Shape::T;
+    constexpr static size_t PART = Shape::PART;
+    constexpr static size_t LAYER = Shape::LAYER;
+
+    struct Mix {
+        std::string name;
+        std::vector<Shape> queries;
+        bool creatable;
+    };
+
+    struct Result {
+        std::string layout;
+        std::string mix;
+        size_t queries;
+        size_t bytes;
+        double p50;
+        double p99;
+        double batchNs;
+        // queries answered differently from the mix
+        size_t wrong;
+    };
+
+    ShapeSet set;
+    std::vector<Mix> mixes;
+    size_t numQueries = 1 << 16;
+    size_t trials = 5;
+
+    template <typename Index>
+    static bool creatable(const Index& halves, const Index& shapes,
+                          Shape shape) {
+        constexpr T mask = repeat<T>(repeat<T>(3, 2, PART / 2), 2 * PART,
+                                     LAYER);
+        for (size_t angle = 0; angle < PART / 2; ++angle) {
+            Shape left{shape.rotate(angle).value & mask};
+            Shape right{shape.rotate(angle + PART / 2).value & mask};
+            if (halves.contains(left.canonicalHalf())
+                    && halves.contains(right.canonicalHalf())) {
+                return true;
+            }
+        }
+        return shapes.contains(shape.canonical());
+    }
+
+    void makeQueries() {
+        SortedIndex halves{set.halves};
+        SortedIndex shapes{set.shapes};
+        SortedIndex none{{}};
+        std::mt19937_64 rng{1};
+        auto pick = [&](const std::vector<Shape>& from) {
+            return from[rng() % from.size()];
+        };
+        auto transform = [&](Shape shape) {
+            shape = shape.rotate(rng() % PART);
+            return rng() % 2 ? shape.flip() : shape;
+        };
+        // gives up on a mix that has too few shapes
+        auto fill = [&](std::string name, bool creatable, auto&& make) {
+            Mix mix{std::move(name), {}, creatable};
+            for (size_t tries = 0; mix.queries.size() < numQueries
+                    && tries < 64 * numQueries; ++tries) {
+                if (auto shape = make()) {
+                    mix.queries.push_back(transform(*shape));
+                }
+            }
+            mixes.push_back(std::move(mix));
+        };
+
+        fill("halves", true, [&]() -> std::optional<Shape> {
+            if (set.halves.empty()) {
+                return std::nullopt;
+            }
+            return pick(set.halves) | pick(set.halves).rotate(PART / 2);
+        });
+        fill("shapes", true, [&]() -> std::optional<Shape> {
+            if (set.shapes.empty()) {
+                return std::nullopt;
+            }
+            Shape shape = pick(set.shapes);
+            if (creatable(halves, none, shape)) {
+                return std::nullopt;
+            }
+            return shape;
+        });
+        // a known shape with one cell changed
+        fill("none", false, [&]() -> std::optional<Shape> {
+            if (set.shapes.empty()) {
+                return std::nullopt;
+            }
+            Shape shape = pick(set.shapes);
+            shape.set(rng() % LAYER, rng() % PART, Type(rng() % 4));
+            if (creatable(halves, shapes, shape)) {
+                return std::nullopt;
+            }
+            return shape;
+        });
+    }
+
+    // The percentiles of the time of single queries, and the time per
+    // query of the fastest pass over the whole mix
+    template <typename Index>
+    void run(const Index& halves, const Index& shapes,
+             std::vector<Result>& results) const {
+        using Clock = std::chrono::steady_clock;
+        using Ns = std::chrono::duration<double, std::nano>;
+
+        // the cost of reading the clock, taken out of the latencies
+        std::vector<double> overheads;
+        for (size_t i = 0; i < 1024; ++i) {
+            auto start = Clock::now();
+            overheads.push_back(Ns(Clock::now() - start).count());
+        }
+        std::sort(overheads.begin(), overheads.end());
+        double overhead = overheads[overheads.size() / 2];
+
+        for (const Mix& mix : mixes) {
+            if (mix.queries.empty()) {
+                continue;
+            }
+            size_t sink = 0;
+            size_t wrong = 0;
+            std::vector<double> latencies;
+            for (Shape query : mix.queries) {
+                auto start = Clock::now();
+                bool found = creatable(halves, shapes, query);
+                latencies.push_back(std::max(0.0,
+                        Ns(Clock::now() - start).count() - overhead));
+                wrong += found != mix.creatable;
+            }
+            std::sort(latencies.begin(), latencies.end());
+            auto percentile = [&](double p) {
+                return latencies[std::min(latencies.size() - 1,
+                                          size_t(p * latencies.size()))];
+            };
+
+            double best = 0;
+            for (size_t trial = 0; trial < trials; ++trial) {
+                auto start = Clock::now();
+                for (Shape query : mix.queries) {
+                    sink += creatable(halves, shapes, query);
+                }
+                double ns = Ns(Clock::now() - start).count()
+                    / mix.queries.size();
+                best = trial == 0 ? ns : std::min(best, ns);
+            }
+            asm volatile("" : "+r"(sink));
+
+            results.push_back({Index::name, mix.name, mix.queries.size(),
+                    halves.bytes() + shapes.bytes(), percentile(0.5),
+                    percentile(0.99), best, wrong});
+        }
+    }
+
+    // The layouts are built one at a time, to need the memory of one
+    std::vector<Result> runAll(const std::set<std::string>& layouts) const {
+        std::vector<Result> results;
+        auto enabled = [&](std::string_view name) {
+            return layouts.empty() || layouts.contains(std::string(name));
+        };
+        if (enabled(SortedIndex::name)) {
+            run(SortedIndex(set.halves), SortedIndex(set.shapes), results);
+        }
+        if (enabled(EytzingerIndex::name)) {
+            run(EytzingerIndex(set.halves), EytzingerIndex(set.shapes),
+                results);
+        }
+        if (enabled(BitmapIndex::name)) {
+            auto halves = BitmapIndex::make(set.halves, true);
+            auto shapes = BitmapIndex::make(set.shapes, false);
+            if (halves && shapes) {
+                run(*halves, *shapes, results);
+            } else {
+                std::cerr << std::format("Skipping {}: {} bits per shape",
+                        BitmapIndex::name, BitmapIndex::keyBits(false))
+                    << std::endl;
+            }
+        }
+        if (enabled(PerfectHashIndex::name)) {
+            run(PerfectHashIndex(set.halves), PerfectHashIndex(set.shapes),
+                results);
+        }
+        return results;
+    }
+};
+
+}
+
+int main(int argc, char* argv[]) {
+    using namespace Shapez;
+
+    LookupBench bench;
+    bool json = false;
+    std::string dump;
+    std::set<std::string> layouts;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--json") {
+            json = true;
+        } else if (arg == "--queries" && i + 1 < argc) {
+            bench.numQueries = std::max(1ul, std::stoul(argv[++i]));
+        } else if (arg == "--trials" && i + 1 < argc) {
+            bench.trials = std::max(1ul, std::stoul(argv[++i]));
+        } else if (arg == "--layout" && i + 1 < argc) {
+            layouts.insert(argv[++i]);
+        } else if (!arg.starts_with("--") && dump.empty()) {
+            dump = arg;
+        } else {
+            dump.clear();
+            break;
+        }
+    }
+    if (dump.empty()) {
+        std::cout << "Usage: bench_lookup [--json] [--queries n] [--trials n] "
+            "[--layout name]... dump.bin" << std::endl;
+        return 1;
+    }
+
+    bench.set = ShapeSet::load(dump);
+    std::sort(bench.set.halves.begin(), bench.set.halves.end());
+    std::sort(bench.set.shapes.begin(), bench.set.shapes.end());
+    bench.makeQueries();
+    for (const auto& mix : bench.mixes) {
+        if (mix.queries.size() < bench.numQueries) {
+            std::cerr << std::format("Only {} queries in the {} mix",
+                    mix.queries.size(), mix.name) << std::endl;
+        }
+    }
+
+    auto results = bench.runAll(layouts);
+    if (json) {
+        std::cout << std::format("{{\"layers\": {}, \"parts\": {}, "
+                "\"halves\": {}, \"shapes\": {}, \"results\": [",
+                Shape::LAYER, Shape::PART, bench.set.halves.size(),
+                bench.set.shapes.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            const auto& r = results[i];
+            std::cout << std::format("{}{{\"layout\": \"{}\", \"mix\": "
+                    "\"{}\", \"queries\": {}, \"bytes\": {}, \"p50_ns\": "
+                    "{:.1f}, \"p99_ns\": {:.1f}, \"batch_ns\": {:.1f}, "
+                    "\"queries_per_second\": {:.0f}}}", i ? ", " : "",
+                    r.layout, r.mix, r.queries, r.bytes, r.p50, r.p99,
+                    r.batchNs, 1e9 / r.batchNs);
+        }
+        std::cout << "]}" << std::endl;
+    } else {
+        std::cout << "layout,mix,queries,bytes,p50_ns,p99_ns,batch_ns,"
+            "queries_per_second" << std::endl;
+        for (const auto& r : results) {
+            std::cout << std::format("{},{},{},{},{:.1f},{:.1f},{:.1f},{:.0f}",
+                    r.layout, r.mix, r.queries, r.bytes, r.p50, r.p99,
+                    r.batchNs, 1e9 / r.batchNs) << std::endl;
+        }
+    }
+
+    // every layout must give the answers of the sorted dump
+    int ret = 0;
+    for (const auto& r : results) {
+        if (r.wrong) {
+            std::cerr << std::format("{} got {} wrong answers in the {} mix",
+                    r.layout, r.wrong, r.mix) << std::endl;
+            ret = 1;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,97 @@
+#!/bin/sh
+# Time the phases of the search on the small configurations, and check the
+# results against the golden counts.
+#
+# Usage: ./bench_search.sh [runs] [config...]
+# A config is a target of `make small`, e.g. search3x4. The fastest of the
+# runs is reported, with one thread unless THREADS is set. Each config is
+# then searched once more split into PARTITIONS processes (3 by default, 1
+# to skip), which must give the golden counts and the same dump.
+set -e
+
+runs=${1:-3}
+[ $# -gt 0 ] && shift
+configs=${*:-"search2x2 search3x2 search4x2 search2x4 search3x4 search2x6"}
+threads=${THREADS:-1}
+partitions=${PARTITIONS:-3}
+
+# shapes, halves, shapes whose halves aren't stable, quarters, digest
+golden() {
+    case $1 in
+    search2x2) echo "175 13 3 14 7021978ef645585c" ;;
+    search3x2) echo "1570 38 63 45 7ffa97a280add777" ;;
+    search4x2) echo "12225 103 808 136 e756ce9f0481749b" ;;
+    search2x4) echo "35281 97 45 14 e5c961c52caec391" ;;
+    search3x4) echo "3865768 917 11627 47 fb54524d79b1d0b4" ;;
+    search2x6) echo "6694921 1336 486 14 2602eef89770ade6" ;;
+    *) echo "unknown config $1" >&2; exit 1 ;;
+    esac
+}
+
+phases="quad_search halves_precalc pair_expansion queue_drain pair_halves
+expand cut stack pin crystal process flush"
+
+stats=$(mktemp)
+output=$(mktemp)
+dump=$(mktemp)
+partitioned=$(mktemp)
+trap 'rm -f "$stats" "$output" "$dump" "$partitioned"' EXIT
+
+# the counts and digest printed by a search
+results() {
+    sed -n 's/^# [^:]*: //p' "$output" | head -5 | tr '\n' ' ' | sed 's/ $//'
+}
+
+printf 'config,elapsed'
+for phase in $phases; do
+    printf ',%s' "$phase"
+done
+printf '\n'
+
+failed=0
+for config in $configs; do
+    expected=$(golden "$config")
+    make -s "$config"
+    best=""
+    run=0
+    while [ $run -lt "$runs" ]; do
+        ./"$config" --threads "$threads" --stats "$stats" "$dump" \
+            > "$output" 2>/dev/null
+        actual=$(results)
+        if [ "$actual" != "$expected" ]; then
+            echo "$config: got $actual, expected $expected" >&2
+            failed=1
+            break
+        fi
+        line=$(sed -n 's/.*"elapsed": \([0-9.]*\).*/\1/p' "$stats")
+        for phase in $phases; do
+            seconds=$(sed -n "s/.*\"$phase\": {\"seconds\": \([0-9.]*\).*/\1/p" \
+                "$stats")
+            line="$line $seconds"
+        done
+        # keep the run with the least elapsed time
+        if [ -z "$best" ] || awk "BEGIN { exit !(${line%% *} < ${best%% *}) }"
+        then
+            best=$line
+        fi
+        run=$((run + 1))
+    done
+    if [ -n "$best" ]; then
+        echo "$config $best" | tr ' ' ','
+    fi
+
+    if [ -n "$best" ] && [ "$partitions" -gt 1 ]; then
+        ./"$config" --threads "$threads" --partitions "$partitions" \
+            "$partitioned" > "$output" 2>/dev/null
+        actual=$(results)
+        if [ "$actual" != "$expected" ]; then
+            echo "$config --partitions $partitions: got $actual," \
+                "expected $expected" >&2
+            failed=1
+        elif ! cmp -s "$dump" "$partitioned"; then
+            echo "$config --partitions $partitions: the dump differs" >&2
+            failed=1
+        fi
+    fi
+done
+exit $failed
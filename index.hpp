@@ -0,0 +1,250 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <numeric>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "shapez.hpp"
+
+// Read-only membership indexes over the sorted shapes or halves of a dump,
+// for answering lookups. They trade memory for the number of cache misses
+// per query; bench_lookup.cpp compares them.
+namespace Shapez::inline SHAPEZ_CONFIG {
+
+// Binary search in the dump as it is. No extra memory.
+class SortedIndex {
+public:
+    static constexpr const char* name = "sorted";
+
+    explicit SortedIndex(std::vector<Shape> sorted)
+        : keys(std::move(sorted)) {}
+
+    bool contains(Shape shape) const {
+        return std::binary_search(keys.begin(), keys.end(), shape);
+    }
+
+    size_t bytes() const {
+        return keys.size() * sizeof(Shape);
+    }
+
+private:
+    std::vector<Shape> keys;
+};
+
+// The keys in the order of a breadth-first walk of the binary search tree,
+// so that the next levels of a search share cache lines and can be
+// prefetched.
+class EytzingerIndex {
+public:
+    static constexpr const char* name = "eytzinger";
+
+    explicit EytzingerIndex(const std::vector<Shape>& sorted)
+        : keys(sorted.size() + 1) {
+        // in-order walk of the implicit tree, which is 1-indexed
+        size_t next = 0;
+        size_t k = 1;
+        std::vector<size_t> stack;
+        while (next < sorted.size()) {
+            if (k < keys.size()) {
+                stack.push_back(k);
+                k = 2 * k;
+            } else {
+                k = stack.back();
+                stack.pop_back();
+                keys[k] = sorted[next++];
+                k = 2 * k + 1;
+            }
+        }
+    }
+
+    bool contains(Shape shape) const {
+        constexpr size_t perLine = 64 / sizeof(Shape);
+        size_t n = keys.size();
+        size_t k = 1;
+        while (k < n) {
+            // the descendants log2(perLine) levels down share a cache line:
+            // four levels for 4-byte shapes, two for 16-byte ones
+            __builtin_prefetch(keys.data() + std::min(k * perLine, n - 1));
+            k = 2 * k + (keys[k] < shape);
+        }
+        // undo the right turns after the last left turn
+        k >>= std::countr_one(k) + 1;
+        return k && keys[k] == shape;
+    }
+
+    size_t bytes() const {
+        return keys.size() * sizeof(Shape);
+    }
+
+private:
+    std::vector<Shape> keys;
+};
+
+// One bit per possible value. Halves only use the west parts, which are
+// packed together first. Only built when it takes at most 512 MB.
+class BitmapIndex {
+public:
+    static constexpr const char* name = "bitmap";
+    static constexpr size_t maxBits = 32;
+
+    using T = Shape::T;
+    static constexpr size_t LAYER = Shape::LAYER;
+    static constexpr size_t PART = Shape::PART;
+
+    static size_t keyBits(bool halves) {
+        return 2 * LAYER * PART / (halves ? 2 : 1);
+    }
+
+    // Not built when the bitmap would be too large
+    static std::optional<BitmapIndex> make(const std::vector<Shape>& sorted,
+                                           bool halves) {
+        if (keyBits(halves) > maxBits) {
+            return std::nullopt;
+        }
+        return BitmapIndex(sorted, halves);
+    }
+
+    bool contains(Shape shape) const {
+        uint64_t k = key(shape);
+        if (halves && (shape.value & ~westMask)) {
+            return false;
+        }
+        return (bits[k / 64] >> (k % 64)) & 1;
+    }
+
+    size_t bytes() const {
+        return bits.size() * sizeof(uint64_t);
+    }
+
+private:
+    static constexpr T westMask = repeat<T>(repeat<T>(3, 2, PART / 2),
+                                            2 * PART, LAYER);
+
+    BitmapIndex(const std::vector<Shape>& sorted, bool halves)
+        : halves(halves),
+          bits(((uint64_t(1) << keyBits(halves)) + 63) / 64) {
+        for (Shape shape : sorted) {
+            uint64_t k = key(shape);
+            bits[k / 64] |= uint64_t(1) << (k % 64);
+        }
+    }
+
+    uint64_t key(Shape shape) const {
+        if (!halves) {
+            return shape.value;
+        }
+        constexpr T layerMask = (T(1) << PART) - 1;
+        uint64_t ret = 0;
+        for (size_t layer = 0; layer < LAYER; ++layer) {
+            T west = (shape.value >> (2 * PART * layer)) & layerMask;
+            ret |= uint64_t(west) << (PART * layer);
+        }
+        return ret;
+    }
+
+    bool halves;
+    std::vector<uint64_t> bits;
+};
+
+// Perfect hash: the keys are hashed to buckets of about four, and each
+// bucket gets a pilot that sends all its keys to free slots (hash and
+// displace). A query reads a pilot and a slot. The slots keep the keys, so
+// that other values are rejected.
+class PerfectHashIndex {
+public:
+    static constexpr const char* name = "perfect_hash";
+
+    using T = Shape::T;
+    // Never canonical, and never a half, as in ShapeTable
+    static constexpr T EMPTY = ~T(0) - 1;
+    static constexpr double loadFactor = 0.95;
+    static constexpr size_t bucketSize = 4;
+
+    explicit PerfectHashIndex(const std::vector<Shape>& sorted)
+        : pilots(std::max<size_t>(1, sorted.size() / bucketSize)),
+          slots(std::max<size_t>(1, sorted.size() / loadFactor + 1),
+                Shape(EMPTY)) {
+        // the keys of each bucket, by counting sort
+        std::vector<size_t> start(pilots.size() + 1);
+        for (Shape shape : sorted) {
+            ++start[bucket(mix64(shape.fold())) + 1];
+        }
+        std::partial_sum(start.begin(), start.end(), start.begin());
+        std::vector<uint64_t> hashes(sorted.size());
+        std::vector<size_t> fill(start.begin(), start.end() - 1);
+        for (Shape shape : sorted) {
+            uint64_t h = mix64(shape.fold());
+            hashes[fill[bucket(h)]++] = h;
+        }
+
+        // the large buckets are the hardest to place, so they go first
+        std::vector<uint32_t> order(pilots.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a,
+                                                         uint32_t b) {
+            return start[a + 1] - start[a] > start[b + 1] - start[b];
+        });
+
+        std::vector<bool> taken(slots.size());
+        std::vector<size_t> placed;
+        for (uint32_t b : order) {
+            if (start[b] == start[b + 1]) {
+                break;
+            }
+            for (uint32_t pilot = 0;; ++pilot) {
+                placed.clear();
+                for (size_t i = start[b]; i < start[b + 1]; ++i) {
+                    size_t s = slot(hashes[i], pilot);
+                    if (taken[s] || std::find(placed.begin(), placed.end(),
+                                              s) != placed.end()) {
+                        break;
+                    }
+                    placed.push_back(s);
+                }
+                if (placed.size() == start[b + 1] - start[b]) {
+                    pilots[b] = pilot;
+                    for (size_t s : placed) {
+                        taken[s] = true;
+                    }
+                    break;
+                }
+            }
+        }
+        for (Shape shape : sorted) {
+            uint64_t h = mix64(shape.fold());
+            slots[slot(h, pilots[bucket(h)])] = shape;
+        }
+    }
+
+    bool contains(Shape shape) const {
+        uint64_t h = mix64(shape.fold());
+        return slots[slot(h, pilots[bucket(h)])] == shape;
+    }
+
+    size_t bytes() const {
+        return pilots.size() * sizeof(uint32_t) + slots.size() * sizeof(Shape);
+    }
+
+private:
+    // h * size / 2^64, which is uniform without a division
+    static size_t range(uint64_t h, size_t size) {
+        return (unsigned __int128)h * size >> 64;
+    }
+
+    size_t bucket(uint64_t h) const {
+        return range(h, pilots.size());
+    }
+
+    size_t slot(uint64_t h, uint32_t pilot) const {
+        return range(mix64(h ^ mix64(pilot)), slots.size());
+    }
+
+    std::vector<uint32_t> pilots;
+    std::vector<Shape> slots;
+};
+
+}
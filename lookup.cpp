@@ -1,21 +1,51 @@
 #include <algorithm>
 #include <iostream>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
 
 #include "3ps/ska/bytell_hash_map.hpp"
 
+#include "perf.hpp"
 #include "shapez.hpp"
 
+namespace Shapez::inline SHAPEZ_CONFIG {
 
-int main(int argc, char* argv[]) {
-    using namespace Shapez;
-
-    if (argc != 3) {
-        std::cout << "Usage: lookup dump.bin shape" << std::endl;
+// Built once per config; shapez.cpp picks one at runtime
+int lookupMain(int argc, char* argv[]) {
+    bool perfEnabled = false;
+    std::vector<const char*> args;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string_view(argv[i]) == "--perf") {
+            perfEnabled = true;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size() != 2) {
+        std::cout << "Usage: lookup [--perf] dump.bin shape" << std::endl;
         return 1;
     }
-    ShapeSet set = ShapeSet::load(argv[1]);
 
-    ska::bytell_hash_set<Shape> halves{set.halves.begin(), set.halves.end()};
+    PerfCounters perf;
+    if (perfEnabled && !perf.open()) {
+        std::cerr << "Hardware counters are not available" << std::endl;
+    }
+    PerfCounters::Values perfLoad{};
+    PerfCounters::Values perfQuery{};
+
+    ShapeSet set;
+    ska::bytell_hash_set<Shape> halves;
+    {
+        PerfCounters::Scope perfScope{perf, perfLoad};
+        try {
+            set = ShapeSet::load(args[0]);
+        } catch (const std::runtime_error& e) {
+            std::cout << e.what() << std::endl;
+            return 1;
+        }
+        halves.insert(set.halves.begin(), set.halves.end());
+    }
 
     auto creatable = [&](Shape shape) {
         constexpr Shape::T mask = repeat<Shape::T>(
@@ -36,12 +66,32 @@ int main(int argc, char* argv[]) {
         return std::binary_search(set.shapes.begin(), set.shapes.end(), repr);
     };
 
-    Shape shape{argv[2]};
-    if (creatable(shape)) {
+    Shape shape{args[1]};
+    bool found;
+    {
+        PerfCounters::Scope perfScope{perf, perfQuery};
+        found = creatable(shape);
+    }
+    if (found) {
         std::cout << "The shape is creatable" << std::endl;
     } else {
         std::cout << "The shape is not creatable" << std::endl;
     }
 
+    if (perf.enabled()) {
+        std::cerr << "Perf load: " << perf.report(perfLoad,
+                set.halves.size() + set.shapes.size(), "shape") << std::endl;
+        std::cerr << "Perf query: " << perf.report(perfQuery, 1, "query")
+            << std::endl;
+    }
+
     return 0;
 }
+
+}
+
+#ifndef SHAPEZ_NO_MAIN
+int main(int argc, char* argv[]) {
+    return Shapez::lookupMain(argc, argv);
+}
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+
+namespace Shapez {
+
+// Bytes allocated by the containers charged to an account, and the most
+// there has been. Updated from any thread.
+struct MemoryAccount {
+    std::atomic<size_t> bytes = 0;
+    std::atomic<size_t> peak = 0;
+
+    void add(size_t n) {
+        size_t now = bytes.fetch_add(n, std::memory_order_relaxed) + n;
+        size_t old = peak.load(std::memory_order_relaxed);
+        while (now > old && !peak.compare_exchange_weak(
+                    old, now, std::memory_order_relaxed)) {}
+    }
+
+    void sub(size_t n) {
+        bytes.fetch_sub(n, std::memory_order_relaxed);
+    }
+};
+
+// Allocator that charges the memory taken from `Base` to an account. The
+// account moves with the memory when containers are assigned or swapped.
+// Without an account, nothing is counted.
+template <typename T, typename Base = std::allocator<T>>
+struct TrackedAllocator {
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    template <typename U>
+    struct rebind {
+        using other = TrackedAllocator<
+            U, typename std::allocator_traits<Base>::template rebind_alloc<U>>;
+    };
+
+    TrackedAllocator(MemoryAccount* account = nullptr) : account(account) {}
+    template <typename U, typename B>
+    TrackedAllocator(const TrackedAllocator<U, B>& other)
+        : account(other.account) {}
+
+    T* allocate(size_t n) {
+        T* p = Base().allocate(n);
+        if (account) {
+            account->add(n * sizeof(T));
+        }
+        return p;
+    }
+
+    void deallocate(T* p, size_t n) {
+        Base().deallocate(p, n);
+        if (account) {
+            account->sub(n * sizeof(T));
+        }
+    }
+
+    template <typename U, typename B>
+    bool operator==(const TrackedAllocator<U, B>& other) const {
+        return account == other.account;
+    }
+
+    MemoryAccount* account;
+};
+
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace Shapez {
+
+// NUMA nodes of the machine, read from sysfs. Memory placement uses the
+// raw syscalls, so there is no dependency on libnuma.
+struct NumaTopology {
+    // node id -> its cpus, for online nodes with cpus
+    std::vector<int> nodes;
+    std::vector<std::vector<int>> cpus;
+
+    static NumaTopology detect() {
+        NumaTopology ret;
+        for (int node : readList("/sys/devices/system/node/online")) {
+            auto nodeCpus = readList("/sys/devices/system/node/node"
+                                     + std::to_string(node) + "/cpulist");
+            if (!nodeCpus.empty()) {
+                ret.nodes.push_back(node);
+                ret.cpus.push_back(std::move(nodeCpus));
+            }
+        }
+        return ret;
+    }
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+    // Run the calling process on the cpus of the i-th node, and allocate
+    // its memory there. Threads created later inherit both.
+    bool bind(size_t i) const {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus[i]) {
+            CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            return false;
+        }
+        return setPolicy(mpolBind, {nodes[i]});
+    }
+
+    // Spread the pages over all the nodes, so that the threads of a single
+    // process share the memory bandwidth of all of them
+    bool interleave() const {
+        return setPolicy(mpolInterleave, nodes);
+    }
+
+private:
+    // from linux/mempolicy.h
+    static constexpr int mpolBind = 2;
+    static constexpr int mpolInterleave = 3;
+    static constexpr size_t maxNodes = 1024;
+
+    static bool setPolicy(int mode, const std::vector<int>& policyNodes) {
+        constexpr size_t bits = 8 * sizeof(unsigned long);
+        unsigned long mask[maxNodes / bits] = {};
+        for (int node : policyNodes) {
+            if (node < 0 || size_t(node) >= maxNodes) {
+                return false;
+            }
+            mask[node / bits] |= 1ul << (node % bits);
+        }
+        return syscall(SYS_set_mempolicy, mode, mask, maxNodes + 1) == 0;
+    }
+
+    // Parse a list like "0-3,8-11"
+    static std::vector<int> readList(const std::string& filename) {
+        std::vector<int> ret;
+        std::ifstream file{filename};
+        std::string range;
+        while (std::getline(file, range, ',')) {
+            std::istringstream stream{range};
+            int first = 0;
+            int last = 0;
+            char dash = 0;
+            if (!(stream >> first)) {
+                continue;
+            }
+            if (!(stream >> dash >> last)) {
+                last = first;
+            }
+            for (int i = first; i <= last; ++i) {
+                ret.push_back(i);
+            }
+        }
+        return ret;
+    }
+};
+
+}
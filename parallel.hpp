@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace Shapez {
+
+// Chase-Lev work-stealing deque of ranges [begin, end), packed in 64 bits.
+// The owner pushes and pops at the bottom; the other workers steal from
+// the top. The capacity is fixed: ranges are split in halves, so a deque
+// never holds more than log2(n) of them.
+class WorkDeque {
+public:
+    static constexpr uint64_t EMPTY = ~uint64_t(0);
+    static constexpr size_t CAPACITY = 128;
+
+    static uint64_t pack(uint32_t begin, uint32_t end) {
+        return (uint64_t(begin) << 32) | end;
+    }
+
+    void push(uint64_t task) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        buffer[b % CAPACITY].store(task, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    uint64_t pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return EMPTY;
+        }
+        uint64_t task = buffer[b % CAPACITY].load(std::memory_order_relaxed);
+        if (t == b) {
+            // the last one, race against the thieves
+            if (!top.compare_exchange_strong(t, t + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                task = EMPTY;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    uint64_t steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return EMPTY;
+        }
+        uint64_t task = buffer[t % CAPACITY].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return EMPTY;
+        }
+        return task;
+    }
+
+private:
+    alignas(64) std::atomic<int64_t> top = 0;
+    alignas(64) std::atomic<int64_t> bottom = 0;
+    alignas(64) std::atomic<uint64_t> buffer[CAPACITY];
+};
+
+// A pool of workers that run parallel loops. The range of a loop starts in
+// the deque of the calling thread (worker 0). A worker splits the range it
+// takes until it is no larger than the grain, pushing the other halves to
+// its own deque, so idle workers can steal large pieces of work.
+class WorkStealingPool {
+public:
+    struct alignas(64) WorkerStats {
+        // ranges executed
+        uint64_t tasks = 0;
+        // ranges taken from another worker
+        uint64_t steals = 0;
+        // time spent looking for work inside a loop
+        std::chrono::steady_clock::duration idle{};
+    };
+
+    explicit WorkStealingPool(size_t threads)
+        : deques(std::max<size_t>(1, threads)),
+          workerStats(std::max<size_t>(1, threads)) {
+        for (size_t id = 1; id < deques.size(); ++id) {
+            workers.emplace_back([this, id](std::stop_token stop) {
+                workerLoop(stop, id);
+            });
+        }
+    }
+
+    ~WorkStealingPool() {
+        for (auto& worker : workers) {
+            worker.request_stop();
+        }
+        epoch.fetch_add(1);
+        epoch.notify_all();
+        workers.clear();
+    }
+
+    size_t size() const {
+        return deques.size();
+    }
+
+    const std::vector<WorkerStats>& stats() const {
+        return workerStats;
+    }
+
+    // Call body(begin, end) over subranges covering [0, n), and wait until
+    // all of them are done
+    void parallelFor(size_t n, size_t grain,
+                     const std::function<void(size_t, size_t)>& body) {
+        if (n == 0) {
+            return;
+        }
+        if (n > 0xffffffff) {
+            throw std::length_error("parallelFor range too large");
+        }
+        if (workers.empty() || n <= grain) {
+            body(0, n);
+            ++workerStats[0].tasks;
+            return;
+        }
+        this->body.store(&body);
+        this->grain.store(std::max<size_t>(1, grain));
+        remaining.store(n);
+        deques[0].push(WorkDeque::pack(0, n));
+        epoch.fetch_add(1);
+        epoch.notify_all();
+        work(0);
+        // don't return while a worker may still touch this loop
+        while (active.load() != 0) {
+            std::this_thread::yield();
+        }
+        this->body.store(nullptr);
+    }
+
+private:
+    void workerLoop(std::stop_token stop, size_t id) {
+        uint64_t seen = 0;
+        while (true) {
+            epoch.wait(seen);
+            seen = epoch.load();
+            if (stop.stop_requested()) {
+                return;
+            }
+            active.fetch_add(1);
+            if (body.load() != nullptr) {
+                work(id);
+            }
+            active.fetch_sub(1);
+        }
+    }
+
+    void work(size_t id) {
+        WorkerStats& stats = workerStats[id];
+        std::minstd_rand random(id);
+        while (remaining.load(std::memory_order_acquire) > 0) {
+            uint64_t task = deques[id].pop();
+            if (task == WorkDeque::EMPTY) {
+                auto start = std::chrono::steady_clock::now();
+                while (remaining.load(std::memory_order_acquire) > 0) {
+                    size_t victim = random() % deques.size();
+                    if (victim != id) {
+                        task = deques[victim].steal();
+                        if (task != WorkDeque::EMPTY) {
+                            ++stats.steals;
+                            break;
+                        }
+                    }
+                    std::this_thread::yield();
+                }
+                stats.idle += std::chrono::steady_clock::now() - start;
+                if (task == WorkDeque::EMPTY) {
+                    return;
+                }
+            }
+            size_t begin = task >> 32;
+            size_t end = task & 0xffffffff;
+            size_t grain = this->grain.load(std::memory_order_relaxed);
+            while (end - begin > grain) {
+                size_t mid = begin + (end - begin) / 2;
+                deques[id].push(WorkDeque::pack(mid, end));
+                end = mid;
+            }
+            (*body.load(std::memory_order_relaxed))(begin, end);
+            ++stats.tasks;
+            remaining.fetch_sub(end - begin, std::memory_order_release);
+        }
+    }
+
+    std::vector<WorkDeque> deques;
+    std::vector<WorkerStats> workerStats;
+    std::vector<std::jthread> workers;
+
+    // the current loop
+    std::atomic<const std::function<void(size_t, size_t)>*> body = nullptr;
+    std::atomic<size_t> grain = 1;
+    std::atomic<size_t> remaining = 0;
+    // bumped to wake up the workers for a new loop
+    std::atomic<uint64_t> epoch = 0;
+    // workers inside a loop
+    std::atomic<size_t> active = 0;
+};
+
+}
@@ -0,0 +1,422 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shapez.hpp"
+
+namespace Shapez::inline SHAPEZ_CONFIG {
+
+inline void writeAll(int fd, const void* data, size_t size) {
+    auto p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EAGAIN) {
+            pollfd pfd{fd, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("failed to write to pipe");
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+inline void readAll(int fd, void* data, size_t size) {
+    auto p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("failed to read from pipe");
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+// Messages of a partitioned search. Every process has an inbox pipe, which
+// all the other processes and the coordinator write to. A message is never
+// larger than PIPE_BUF, so it is written atomically and messages from
+// different writers don't interleave.
+struct PartitionMessage {
+    enum Kind : uint32_t {
+        // shapes owned by the receiver
+        SHAPES,
+        // newly found halves
+        HALVES,
+        // the coordinator asks for the counters, once the receiver is idle
+        PROBE,
+        // the search is over
+        STOP,
+    };
+
+    struct Header {
+        uint32_t kind;
+        uint32_t size;
+    };
+
+    static constexpr size_t maxShapes =
+        (PIPE_BUF - sizeof(Header)) / sizeof(Shape);
+};
+
+// One process of a partitioned search. Each process owns the canonical
+// shapes whose hash falls in its partition. Data messages are written
+// without blocking, so two busy processes never wait on each other, and the
+// ones that don't fit in the pipe are kept until the next `exchange()`.
+class PartitionPeer {
+public:
+    using Handler = std::function<void(PartitionMessage::Kind,
+                                       std::span<const Shape>)>;
+    // How long a wait can go without calling its idle function, in ms
+    static constexpr int idleInterval = 1000;
+
+    // Reply to a probe: data messages sent and received so far
+    struct Counters {
+        uint64_t sent = 0;
+        uint64_t received = 0;
+    };
+
+    const size_t id;
+
+    // `inboxes` are the write ends of the inboxes of all the processes
+    PartitionPeer(size_t id, std::vector<int> inboxes, int inbox, int up)
+        : id(id), inboxes(std::move(inboxes)), inbox(inbox), up(up),
+          outboxes(this->inboxes.size()) {}
+
+    size_t size() const {
+        return inboxes.size();
+    }
+
+    size_t owner(Shape shape) const {
+        return mix64(shape.fold()) % size();
+    }
+
+    void sendShape(size_t dest, Shape shape) {
+        outboxes[dest].shapes.push_back(shape);
+    }
+
+    void broadcastHalf(Shape half) {
+        for (size_t dest = 0; dest < size(); ++dest) {
+            if (dest != id) {
+                outboxes[dest].halves.push_back(half);
+            }
+        }
+    }
+
+    // Send what the pipes can take, and handle all the received messages
+    void exchange(const Handler& handler) {
+        send();
+        receive(handler);
+    }
+
+    // Called when there is no local work. Returns true when data messages
+    // have been received and may have brought new work, or false when the
+    // coordinator stops the search. `idle` is called after a signal, and
+    // at least every `idleInterval` while nothing comes, since a blocked
+    // poll isn't restarted by a handler and would never see the signal.
+    bool waitForWork(const Handler& handler,
+                     const std::function<void()>& idle) {
+        while (true) {
+            bool pendingOutput = !send();
+            if (receive(handler)) {
+                return true;
+            }
+            if (!pendingOutput) {
+                if (probed) {
+                    probed = false;
+                    writeAll(up, &counters, sizeof(counters));
+                }
+                if (stopped) {
+                    return false;
+                }
+            }
+            std::vector<pollfd> fds{{inbox, POLLIN, 0}};
+            for (size_t dest = 0; dest < size() && pendingOutput; ++dest) {
+                if (!outboxes[dest].empty()) {
+                    fds.push_back({inboxes[dest], POLLOUT, 0});
+                }
+            }
+            if (poll(fds.data(), fds.size(), idleInterval) <= 0) {
+                idle();
+            }
+        }
+    }
+
+private:
+    struct Outbox {
+        std::vector<Shape> shapes;
+        std::vector<Shape> halves;
+        size_t sentShapes = 0;
+        size_t sentHalves = 0;
+
+        bool empty() const {
+            return sentShapes == shapes.size() && sentHalves == halves.size();
+        }
+    };
+
+    // Write messages until a pipe is full. Returns true if all are sent.
+    // Halves go first, so the receiver can drop the shapes they make.
+    bool send() {
+        bool done = true;
+        for (size_t dest = 0; dest < size(); ++dest) {
+            Outbox& out = outboxes[dest];
+            bool full = !sendAll(dest, PartitionMessage::HALVES, out.halves,
+                                 out.sentHalves)
+                || !sendAll(dest, PartitionMessage::SHAPES, out.shapes,
+                            out.sentShapes);
+            done &= !full;
+        }
+        return done;
+    }
+
+    bool sendAll(size_t dest, PartitionMessage::Kind kind,
+                 std::vector<Shape>& shapes, size_t& sent) {
+        char buffer[PIPE_BUF];
+        while (sent < shapes.size()) {
+            size_t n = std::min(shapes.size() - sent,
+                                PartitionMessage::maxShapes);
+            PartitionMessage::Header header{kind, uint32_t(n)};
+            std::memcpy(buffer, &header, sizeof(header));
+            std::memcpy(buffer + sizeof(header), &shapes[sent],
+                        n * sizeof(Shape));
+            size_t len = sizeof(header) + n * sizeof(Shape);
+            ssize_t written = write(inboxes[dest], buffer, len);
+            if (written < 0 && (errno == EAGAIN || errno == EINTR)) {
+                return false;
+            }
+            if (written != ssize_t(len)) {
+                throw std::runtime_error("failed to write to pipe");
+            }
+            sent += n;
+            ++counters.sent;
+        }
+        shapes.clear();
+        sent = 0;
+        return true;
+    }
+
+    // Handle the complete messages in the inbox. Returns true if there was
+    // a data message.
+    bool receive(const Handler& handler) {
+        bool gotData = false;
+        while (true) {
+            size_t old = buffer.size();
+            buffer.resize(old + 16 * PIPE_BUF);
+            ssize_t n = read(inbox, buffer.data() + old, 16 * PIPE_BUF);
+            buffer.resize(old + std::max<ssize_t>(n, 0));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && errno != EAGAIN) {
+                throw std::runtime_error("failed to read from pipe");
+            }
+            size_t pos = 0;
+            PartitionMessage::Header header;
+            while (buffer.size() - pos >= sizeof(header)) {
+                std::memcpy(&header, &buffer[pos], sizeof(header));
+                size_t len = sizeof(header) + header.size * sizeof(Shape);
+                if (buffer.size() - pos < len) {
+                    break;
+                }
+                auto kind = PartitionMessage::Kind(header.kind);
+                if (kind == PartitionMessage::PROBE) {
+                    probed = true;
+                } else if (kind == PartitionMessage::STOP) {
+                    stopped = true;
+                } else {
+                    shapes.resize(header.size);
+                    std::memcpy(shapes.data(), &buffer[pos + sizeof(header)],
+                                header.size * sizeof(Shape));
+                    handler(kind, shapes);
+                    ++counters.received;
+                    gotData = true;
+                }
+                pos += len;
+            }
+            buffer.erase(buffer.begin(), buffer.begin() + pos);
+            if (n <= 0) {
+                return gotData;
+            }
+        }
+    }
+
+    std::vector<int> inboxes;
+    int inbox;
+    // pipe to the coordinator
+    int up;
+    std::vector<Outbox> outboxes;
+    // received bytes, which may end in a partial message
+    std::vector<char> buffer;
+    std::vector<Shape> shapes;
+    Counters counters;
+    bool probed = false;
+    bool stopped = false;
+};
+
+// Starts the processes of a partitioned search, and detects when all of
+// them are done. The search is over when all processes are idle and no
+// message is in flight. This is checked with the four counter method:
+// each round probes every process once it is idle, and the search is over
+// when two consecutive rounds see the same counters, with as many data
+// messages received as sent.
+class PartitionCoordinator {
+public:
+    // Fork `n` processes, each running `work` with its own peer. `work`
+    // must write its result to the `up` pipe of the peer, which is passed
+    // as the second argument.
+    PartitionCoordinator(size_t n,
+                         const std::function<void(PartitionPeer&, int)>& work)
+        : inboxes(n), ups(n), pids(n) {
+        std::cout.flush();
+        std::vector<int> readEnds(n);
+        for (size_t i = 0; i < n; ++i) {
+            int fds[2];
+            if (pipe2(fds, O_NONBLOCK) != 0) {
+                throw std::runtime_error("failed to create pipe");
+            }
+            readEnds[i] = fds[0];
+            inboxes[i] = fds[1];
+        }
+        for (size_t i = 0; i < n; ++i) {
+            int fds[2];
+            if (pipe(fds) != 0) {
+                throw std::runtime_error("failed to create pipe");
+            }
+            pid_t pid = fork();
+            if (pid < 0) {
+                throw std::runtime_error("failed to fork");
+            }
+            if (pid == 0) {
+                close(fds[0]);
+                for (size_t j = 0; j < i; ++j) {
+                    close(ups[j]);
+                }
+                for (size_t j = 0; j < n; ++j) {
+                    if (j != i) {
+                        close(readEnds[j]);
+                    }
+                }
+                int status = 0;
+                try {
+                    PartitionPeer peer(i, inboxes, readEnds[i], fds[1]);
+                    work(peer, fds[1]);
+                } catch (const std::exception& e) {
+                    std::cerr << e.what() << std::endl;
+                    status = 1;
+                }
+                std::cout.flush();
+                _exit(status);
+            }
+            close(fds[1]);
+            ups[i] = fds[0];
+            pids[i] = pid;
+        }
+        for (int fd : readEnds) {
+            close(fd);
+        }
+    }
+
+    // Wait until the search is over, and stop the processes. Their results
+    // can be read from `up(i)` afterwards. `idle` is called as in
+    // `PartitionPeer::waitForWork` while a process is busy.
+    void wait(const std::function<void()>& idle) {
+        PartitionPeer::Counters last{~uint64_t(0), 0};
+        while (true) {
+            broadcast(PartitionMessage::PROBE);
+            PartitionPeer::Counters total;
+            for (int fd : ups) {
+                pollfd ready{fd, POLLIN, 0};
+                while (poll(&ready, 1, PartitionPeer::idleInterval) <= 0) {
+                    idle();
+                }
+                PartitionPeer::Counters counters;
+                readAll(fd, &counters, sizeof(counters));
+                total.sent += counters.sent;
+                total.received += counters.received;
+            }
+            if (total.sent == total.received && total.sent == last.sent
+                    && total.received == last.received) {
+                break;
+            }
+            last = total;
+        }
+        broadcast(PartitionMessage::STOP);
+    }
+
+    // Kill the processes if the search didn't finish, e.g. one of them
+    // failed and the others wait for it forever
+    ~PartitionCoordinator() {
+        for (pid_t pid : pids) {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+    }
+
+    int up(size_t i) const {
+        return ups[i];
+    }
+
+    void signal(int sig) const {
+        for (pid_t pid : pids) {
+            kill(pid, sig);
+        }
+    }
+
+    // Reap the processes. Returns false if any of them failed.
+    bool join() {
+        bool ok = true;
+        for (pid_t pid : pids) {
+            int status = 0;
+            if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+                    || WEXITSTATUS(status) != 0) {
+                ok = false;
+            }
+        }
+        for (int fd : ups) {
+            close(fd);
+        }
+        for (int fd : inboxes) {
+            close(fd);
+        }
+        pids.clear();
+        return ok;
+    }
+
+private:
+    void broadcast(PartitionMessage::Kind kind) {
+        PartitionMessage::Header header{kind, 0};
+        for (int fd : inboxes) {
+            writeAll(fd, &header, sizeof(header));
+        }
+    }
+
+    // write ends of the inboxes
+    std::vector<int> inboxes;
+    // read ends of the pipes from the processes
+    std::vector<int> ups;
+    std::vector<pid_t> pids;
+};
+
+}
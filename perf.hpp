@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <string>
+#include <utility>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace Shapez {
+
+// Hardware counters of the calling process and the threads it creates
+// later, read with perf_event_open. Events the machine or the kernel
+// doesn't allow are left out.
+class PerfCounters {
+public:
+    enum Event {
+        CYCLES,
+        INSTRUCTIONS,
+        LLC_MISSES,
+        DTLB_MISSES,
+        BRANCH_MISSES,
+        NUM_EVENTS,
+    };
+
+    using Values = std::array<uint64_t, NUM_EVENTS>;
+
+    PerfCounters() {
+        fds.fill(-1);
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters() {
+        for (int fd : fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    // Start counting. Returns false if no event can be counted.
+    bool open() {
+        constexpr uint64_t dtlbReadMiss = PERF_COUNT_HW_CACHE_DTLB
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        const std::pair<uint32_t, uint64_t> events[NUM_EVENTS] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HW_CACHE, dtlbReadMiss},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        };
+        bool any = false;
+        for (size_t i = 0; i < NUM_EVENTS; ++i) {
+            fds[i] = openEvent(events[i].first, events[i].second);
+            any |= fds[i] >= 0;
+        }
+        return any;
+    }
+
+    bool enabled() const {
+        for (int fd : fds) {
+            if (fd >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The counts so far, scaled up when the kernel had to multiplex the
+    // counters
+    Values read() const {
+        Values ret{};
+        for (size_t i = 0; i < NUM_EVENTS; ++i) {
+            uint64_t data[3] = {};
+            if (fds[i] < 0 || ::read(fds[i], data, sizeof(data))
+                    != sizeof(data)) {
+                continue;
+            }
+            // value, time enabled, time running
+            ret[i] = data[2] == 0 ? 0
+                : uint64_t(double(data[0]) * data[1] / data[2]);
+        }
+        return ret;
+    }
+
+    // IPC, and the misses per unit of work (e.g. per shape)
+    std::string report(const Values& values, uint64_t units,
+                       const char* unit) const {
+        auto perUnit = [&](Event event) -> std::string {
+            if (fds[event] < 0) {
+                return "-";
+            }
+            return std::format("{:.2f}", units ? double(values[event]) / units
+                                               : 0.);
+        };
+        std::string ipc = "-";
+        if (fds[CYCLES] >= 0 && fds[INSTRUCTIONS] >= 0 && values[CYCLES]) {
+            ipc = std::format("{:.2f}",
+                              double(values[INSTRUCTIONS]) / values[CYCLES]);
+        }
+        return std::format("{} IPC, {} LLC misses, {} dTLB misses, {} branch "
+                "misses per {}", ipc, perUnit(LLC_MISSES),
+                perUnit(DTLB_MISSES), perUnit(BRANCH_MISSES), unit);
+    }
+
+    // Adds the counts of the enclosing scope to `total`
+    class Scope {
+    public:
+        Scope(const PerfCounters& perf, Values& total)
+            : perf(perf), total(total) {
+            if (perf.enabled()) {
+                start = perf.read();
+            }
+        }
+
+        ~Scope() {
+            if (perf.enabled()) {
+                Values end = perf.read();
+                // scaled counts may go back a little
+                for (size_t i = 0; i < NUM_EVENTS; ++i) {
+                    total[i] += std::max(end[i], start[i]) - start[i];
+                }
+            }
+        }
+
+    private:
+        const PerfCounters& perf;
+        Values& total;
+        Values start{};
+    };
+
+private:
+    static int openEvent(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+            | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // Only user space, which unprivileged processes are allowed to count
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // Count the worker threads, but not forked processes such as the
+        // checkpoint writer. Older kernels only have `inherit`.
+        attr.inherit = 1;
+        attr.inherit_thread = 1;
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                         PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0) {
+            attr.inherit_thread = 0;
+            fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                         PERF_FLAG_FD_CLOEXEC);
+        }
+        return fd;
+    }
+
+    std::array<int, NUM_EVENTS> fds;
+};
+
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <type_traits>
+#include <vector>
+
+#include "memory.hpp"
+#include "shapez.hpp"
+
+namespace Shapez::inline SHAPEZ_CONFIG {
+
+// FIFO queue of canonical shapes for the BFS of the searcher. New shapes
+// are collected in a tail buffer. A full buffer is sorted, and stored as
+// the deltas between consecutive shapes in LEB128 varints, which take
+// fewer bytes than sizeof(Shape) because the shapes of a block are dense.
+// The front block is decoded when the queue drains to it. The order is
+// only changed within a block, and the sorted order also makes the probes
+// of the shapes processed together closer in memory.
+//
+// The tail and the decoded head are not compressed, so a block is a
+// sixteenth of the queue, between `minBlock` shapes and `maxBlock` bytes
+// of shapes. A small queue then has small buffers, and a large one gets
+// large, dense blocks.
+class ShapeQueue {
+public:
+    static constexpr size_t minBlock = 1 << 12;
+    static constexpr size_t maxBlock = (size_t(1) << 22) / sizeof(Shape);
+
+    // The memory of the queue is charged to `account`, if any
+    explicit ShapeQueue(MemoryAccount* account = nullptr)
+        : head(account), blocks(account), tail(account) {}
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    Shape front() {
+        load();
+        return head[headPos];
+    }
+
+    void pop_front() {
+        load();
+        ++headPos;
+        --count;
+    }
+
+    void push_back(Shape shape) {
+        tail.push_back(shape);
+        ++count;
+        if (tail.size() >= std::clamp(count / 16, minBlock, maxBlock)) {
+            seal();
+        }
+    }
+
+    // Put back a shape just taken from the front
+    void push_front(Shape shape) {
+        if (headPos == 0) {
+            // make room for as many shapes as the head has
+            size_t room = std::max<size_t>(head.size(), 64);
+            head.insert(head.begin(), room, Shape());
+            headPos = room;
+        }
+        head[--headPos] = shape;
+        ++count;
+    }
+
+    void shrink_to_fit() {
+        if (headPos == head.size()) {
+            head = Shapes(head.get_allocator());
+            headPos = 0;
+        }
+        tail.shrink_to_fit();
+        blocks.shrink_to_fit();
+    }
+
+    // Memory used by the queue
+    size_t bytes() const {
+        size_t ret = (head.capacity() + tail.capacity()) * sizeof(Shape);
+        for (const auto& block : blocks) {
+            ret += block.bytes.capacity();
+        }
+        return ret;
+    }
+
+    // Call `f` for each shape in the queue, from the front to the back
+    template <typename F>
+    void forEach(F&& f) const {
+        for (size_t i = headPos; i < head.size(); ++i) {
+            f(head[i]);
+        }
+        Shapes decoded(head.get_allocator());
+        for (const auto& block : blocks) {
+            decode(block, decoded);
+            for (Shape shape : decoded) {
+                f(shape);
+            }
+        }
+        for (Shape shape : tail) {
+            f(shape);
+        }
+    }
+
+private:
+    using Shapes = std::vector<Shape, TrackedAllocator<Shape>>;
+    using Bytes = std::vector<uint8_t, TrackedAllocator<uint8_t>>;
+    // the gaps between sorted shapes, as varints
+    using Delta = std::conditional_t<sizeof(Shape::T) <= sizeof(uint64_t),
+                                     uint64_t, Shape::T>;
+
+    struct Block {
+        Bytes bytes;
+        size_t size;
+    };
+
+    // Compress the tail into a block
+    void seal() {
+        std::sort(tail.begin(), tail.end());
+        Bytes bytes(tail.get_allocator());
+        bytes.reserve(tail.size() * 3);
+        Delta last = 0;
+        for (Shape shape : tail) {
+            Delta delta = shape.value - last;
+            last = shape.value;
+            while (delta >= 0x80) {
+                bytes.push_back(uint8_t(delta) | 0x80);
+                delta >>= 7;
+            }
+            bytes.push_back(uint8_t(delta));
+        }
+        bytes.shrink_to_fit();
+        blocks.push_back({std::move(bytes), tail.size()});
+        tail.clear();
+    }
+
+    static void decode(const Block& block, Shapes& shapes) {
+        shapes.resize(block.size);
+        const uint8_t* p = block.bytes.data();
+        Delta last = 0;
+        for (size_t i = 0; i < block.size; ++i) {
+            Delta delta = 0;
+            for (size_t shift = 0;; shift += 7) {
+                uint8_t byte = *p++;
+                delta |= Delta(byte & 0x7f) << shift;
+                if (byte < 0x80) {
+                    break;
+                }
+            }
+            last += delta;
+            shapes[i] = Shape(Shape::T(last));
+        }
+    }
+
+    // Make sure the head has a shape, if the queue is not empty
+    void load() {
+        if (headPos < head.size()) {
+            return;
+        }
+        headPos = 0;
+        if (!blocks.empty()) {
+            decode(blocks.front(), head);
+            blocks.pop_front();
+        } else {
+            std::sort(tail.begin(), tail.end());
+            head.swap(tail);
+            tail.clear();
+        }
+    }
+
+    // decoded front of the queue, from `headPos`
+    Shapes head;
+    size_t headPos = 0;
+    std::deque<Block, TrackedAllocator<Block>> blocks;
+    // back of the queue, not compressed yet
+    Shapes tail;
+    size_t count = 0;
+};
+
+}
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include "shapez.hpp"
+
+// Reference implementations of the shape operations, to check the fast
+// ones in `Shape` against. They work cell by cell on a grid, follow the
+// rules as written in the comments of `Shape`, and are not meant to be
+// fast. Don't optimize them.
+namespace Shapez::inline SHAPEZ_CONFIG::reference {
+
+constexpr size_t LAYER = Shape::LAYER;
+constexpr size_t PART = Shape::PART;
+
+using Grid = std::array<std::array<Type, PART>, LAYER>;
+// whether each cell is selected
+using Cells = std::array<std::array<bool, PART>, LAYER>;
+
+inline Grid toGrid(Shape shape) {
+    Grid grid;
+    for (size_t layer = 0; layer < LAYER; ++layer) {
+        for (size_t part = 0; part < PART; ++part) {
+            grid[layer][part] = shape.get(layer, part);
+        }
+    }
+    return grid;
+}
+
+inline Shape fromGrid(const Grid& grid) {
+    Shape shape;
+    for (size_t layer = 0; layer < LAYER; ++layer) {
+        for (size_t part = 0; part < PART; ++part) {
+            shape.set(layer, part, grid[layer][part]);
+        }
+    }
+    return shape;
+}
+
+// A bitmask in the layout of `Shape`, with 0b11 for the selected cells
+inline Shape::T toMask(const Cells& cells) {
+    Shape::T mask = 0;
+    for (size_t layer = 0; layer < LAYER; ++layer) {
+        for (size_t part = 0; part < PART; ++part) {
+            if (cells[layer][part]) {
+                mask |= Shape::T(3) << (2 * (layer * PART + part));
+            }
+        }
+    }
+    return mask;
+}
+
+inline Cells fromMask(Shape::T mask) {
+    Cells cells{};
+    for (size_t layer = 0; layer < LAYER; ++layer) {
+        for (size_t part = 0; part < PART; ++part) {
+            cells[layer][part] = (mask >> (2 * (layer * PART + part))) & 3;
+        }
+    }
+    return cells;
+}
+
+inline size_t next(size_t part) {
+    return (part + 1) % PART;
+}
+
+inline size_t prev(size_t part) {
+    return (part + PART - 1) % PART;
+}
+
+inline bool isSolid(Type type) {
+    return type == Type::Shape || type == Type::Crystal;
+}
+
+// Repeat until nothing changes: a part is supported if it's on the bottom
+// layer, directly above a supported part, connected horizontally to a
+// supported solid part (pins don't connect), or a crystal directly under
+// a supported crystal.
+inline Cells supportedPart(const Grid& grid) {
+    Cells supported{};
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t layer = 0; layer < LAYER; ++layer) {
+            for (size_t part = 0; part < PART; ++part) {
+                Type type = grid[layer][part];
+                if (type == Type::Empty || supported[layer][part]) {
+                    continue;
+                }
+                bool ok = layer == 0 || supported[layer - 1][part];
+                for (size_t other : {next(part), prev(part)}) {
+                    ok |= type != Type::Pin && supported[layer][other]
+                        && isSolid(grid[layer][other]);
+                }
+                ok |= type == Type::Crystal && layer + 1 < LAYER
+                    && supported[layer + 1][part]
+                    && grid[layer + 1][part] == Type::Crystal;
+                if (ok) {
+                    supported[layer][part] = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+    return supported;
+}
+
+// The unsupported cells fall in pieces, one by one from the bottom layer.
+// A pin is a piece on its own, and adjacent shapes of a layer form one
+// piece. Falling crystals break.
+inline Grid collapse(const Grid& grid) {
+    Cells supported = supportedPart(grid);
+    Grid ret{};
+    for (auto& layer : ret) {
+        layer.fill(Type::Empty);
+    }
+    Grid falling = ret;
+    for (size_t layer = 0; layer < LAYER; ++layer) {
+        for (size_t part = 0; part < PART; ++part) {
+            Type type = grid[layer][part];
+            if (supported[layer][part]) {
+                ret[layer][part] = type;
+            } else if (type != Type::Crystal) {
+                falling[layer][part] = type;
+            }
+        }
+    }
+
+    // Let a piece fall from its layer while the layer below has room for
+    // it. A piece that doesn't fit where it is is lost.
+    auto stack = [&](size_t layer, const std::vector<size_t>& parts,
+                     Type type) {
+        auto fits = [&](size_t l) {
+            for (size_t part : parts) {
+                if (ret[l][part] != Type::Empty) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        if (!fits(layer)) {
+            return;
+        }
+        while (layer > 0 && fits(layer - 1)) {
+            --layer;
+        }
+        for (size_t part : parts) {
+            ret[layer][part] = type;
+        }
+    };
+
+    for (size_t layer = 0; layer < LAYER; ++layer) {
+        std::array<bool, PART> done{};
+        for (size_t part = 0; part < PART; ++part) {
+            Type type = falling[layer][part];
+            if (done[part] || type == Type::Empty) {
+                continue;
+            }
+            if (type == Type::Pin) {
+                done[part] = true;
+                stack(layer, {part}, Type::Pin);
+                continue;
+            }
+            // the run of shapes through this part, around the layer
+            std::vector<size_t> parts{part};
+            done[part] = true;
+            for (size_t p = next(part); p != part
+                    && falling[layer][p] == Type::Shape && !done[p];
+                    p = next(p)) {
+                parts.push_back(p);
+                done[p] = true;
+            }
+            for (size_t p = prev(part); p != part
+                    && falling[layer][p] == Type::Shape && !done[p];
+                    p = prev(p)) {
+                parts.push_back(p);
+                done[p] = true;
+            }
+            stack(layer, parts, Type::Shape);
+        }
+    }
+    return ret;
+}
+
+// Break the crystals of the selected cells, and the crystals connected to
+// them in any of the four directions
+inline Grid breakCrystals(const Grid& grid, const Cells& cells) {
+    Grid ret = grid;
+    Cells broken{};
+    for (size_t layer = 0; layer < LAYER; ++layer) {
+        for (size_t part = 0; part < PART; ++part) {
+            broken[layer][part] = cells[layer][part]
+                && grid[layer][part] == Type::Crystal;
+        }
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t layer = 0; layer < LAYER; ++layer) {
+            for (size_t part = 0; part < PART; ++part) {
+                if (broken[layer][part]
+                        || grid[layer][part] != Type::Crystal) {
+                    continue;
+                }
+                bool touches = broken[layer][next(part)]
+                    || broken[layer][prev(part)]
+                    || (layer > 0 && broken[layer - 1][part])
+                    || (layer + 1 < LAYER && broken[layer + 1][part]);
+                if (touches) {
+                    broken[layer][part] = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+    for (size_t layer = 0; layer < LAYER; ++layer) {
+        for (size_t part = 0; part < PART; ++part) {
+            if (broken[layer][part]) {
+                ret[layer][part] = Type::Empty;
+            }
+        }
+    }
+    return ret;
+}
+
+// The parts of the west half: the first PART / 2 of each layer
+inline bool isWest(size_t part) {
+    return part < PART / 2;
+}
+
+inline Grid cut(const Grid& grid) {
+    Cells east{};
+    for (auto& layer : east) {
+        for (size_t part = 0; part < PART; ++part) {
+            layer[part] = !isWest(part);
+        }
+    }
+    Grid ret = breakCrystals(grid, east);
+    for (auto& layer : ret) {
+        for (size_t part = 0; part < PART; ++part) {
+            if (!isWest(part)) {
+                layer[part] = Type::Empty;
+            }
+        }
+    }
+    return collapse(ret);
+}
+
+// Break the crystals of the top layer, push everything up a layer (losing
+// the top layer), put pins under the non-empty parts of the bottom layer,
+// and apply gravity
+inline Grid pin(const Grid& grid) {
+    Cells top{};
+    top[LAYER - 1].fill(true);
+    Grid broken = breakCrystals(grid, top);
+    Grid ret{};
+    for (size_t part = 0; part < PART; ++part) {
+        ret[0][part] = grid[0][part] != Type::Empty ? Type::Pin : Type::Empty;
+    }
+    for (size_t layer = 1; layer < LAYER; ++layer) {
+        ret[layer] = broken[layer - 1];
+    }
+    return collapse(ret);
+}
+
+inline Grid rotate(const Grid& grid, size_t n) {
+    Grid ret;
+    for (size_t layer = 0; layer < LAYER; ++layer) {
+        for (size_t part = 0; part < PART; ++part) {
+            ret[layer][part] = grid[layer][(part + n) % PART];
+        }
+    }
+    return ret;
+}
+
+inline Grid flip(const Grid& grid) {
+    Grid ret;
+    for (size_t layer = 0; layer < LAYER; ++layer) {
+        for (size_t part = 0; part < PART; ++part) {
+            ret[layer][part] = grid[layer][PART - 1 - part];
+        }
+    }
+    return ret;
+}
+
+// The smallest value among the rotations and flips
+inline Shape canonical(Shape shape) {
+    Grid grid = toGrid(shape);
+    Shape ret = shape;
+    for (size_t angle = 0; angle < PART; ++angle) {
+        Grid rotated = rotate(grid, angle);
+        ret = std::min({ret, fromGrid(rotated), fromGrid(flip(rotated))});
+    }
+    return ret;
+}
+
+// The smallest of a half and its mirror, which is also a west half
+inline Shape canonicalHalf(Shape half) {
+    return std::min(half, fromGrid(rotate(flip(toGrid(half)), PART / 2)));
+}
+
+}
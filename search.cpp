@@ -1,14 +1,37 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
 #include <deque>
 #include <format>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <optional>
+#include <span>
+#include <string_view>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "3ps/ska/bytell_hash_map.hpp"
 
+#include "arena.hpp"
+#include "memory.hpp"
+#include "numa.hpp"
+#include "parallel.hpp"
+#include "partition.hpp"
+#include "perf.hpp"
+#include "queue.hpp"
 #include "shapez.hpp"
+#include "stats.hpp"
+#include "table.hpp"
+#include "trace.hpp"
 
-namespace Shapez {
+namespace Shapez::inline SHAPEZ_CONFIG {
 
 // Search possible quads. This searcher is conservative, which means that
 // it may omit some quads, but any quad found by it is always makeable.
@@ -66,6 +89,235 @@ struct ConservativeQuadSearcher {
     }
 };
 
+// Index of the halves by their columns, used when a half is made of two
+// columns with up to 6 layers (PART == 4), or of three with up to 4 layers
+// (PART == 6), where the table stays within 64 MB and the column ids fit
+// in 16 bits. Taller shapes use the Bloom filter and `halvesIdx`. Flipping a half reverses its columns. The
+// columns seen in any half get dense ids, so a lookup is a few reads in a
+// small array and one in the table of id tuples, instead of canonicalizing
+// and hashing the half.
+struct HalfTable {
+    static constexpr size_t COLUMNS = Shape::PART / 2;
+    static constexpr bool enabled =
+        (COLUMNS == 2 && Shape::LAYER <= 6)
+        || (COLUMNS == 3 && Shape::LAYER <= 4);
+    static constexpr uint32_t none = ~uint32_t(0);
+    static constexpr uint16_t noColumn = ~uint16_t(0);
+
+    // column bits -> dense column id
+    std::vector<uint16_t> columnId = std::vector<uint16_t>(
+        enabled ? size_t(1) << (2 * Shape::LAYER) : 0, noColumn);
+    size_t numColumns = 0;
+    // [(id0 * stride + id1) * stride + ...] -> half index
+    size_t stride = 0;
+    std::vector<uint32_t, HugePageAllocator<uint32_t>> halfIdx;
+
+    // The half of COLUMNS consecutive columns
+    uint32_t find(const uint32_t* columns) const {
+        size_t idx = 0;
+        for (size_t i = 0; i < COLUMNS; ++i) {
+            uint16_t id = columnId[columns[i]];
+            if (id == noColumn) {
+                return none;
+            }
+            idx = idx * stride + id;
+        }
+        return halfIdx[idx];
+    }
+
+    void add(Shape half, uint32_t idx) {
+        std::array<uint16_t, COLUMNS> ids;
+        for (size_t i = 0; i < COLUMNS; ++i) {
+            ids[i] = addColumn(half.column(i));
+        }
+        size_t forward = 0;
+        size_t backward = 0;
+        for (size_t i = 0; i < COLUMNS; ++i) {
+            forward = forward * stride + ids[i];
+            backward = backward * stride + ids[COLUMNS - 1 - i];
+        }
+        halfIdx[forward] = idx;
+        halfIdx[backward] = idx;
+    }
+
+    uint16_t addColumn(uint32_t column) {
+        if (columnId[column] != noColumn) {
+            return columnId[column];
+        }
+        if (numColumns == stride) {
+            // grow the table, moving each row of `stride` entries
+            size_t newStride = std::max<size_t>(64, stride * 2);
+            size_t newSize = 1;
+            size_t rows = 1;
+            for (size_t i = 0; i < COLUMNS; ++i) {
+                newSize *= newStride;
+                rows *= i + 1 < COLUMNS ? stride : 1;
+            }
+            std::vector<uint32_t, HugePageAllocator<uint32_t>> newIdx(
+                    newSize, none);
+            for (size_t row = 0; row < rows && stride; ++row) {
+                size_t newRow = 0;
+                size_t scale = 1;
+                for (size_t rest = row, i = 0; i + 1 < COLUMNS; ++i) {
+                    newRow += rest % stride * scale;
+                    rest /= stride;
+                    scale *= newStride;
+                }
+                std::copy_n(&halfIdx[row * stride], stride,
+                            &newIdx[newRow * newStride]);
+            }
+            halfIdx = std::move(newIdx);
+            stride = newStride;
+        }
+        columnId[column] = numColumns;
+        return numColumns++;
+    }
+};
+
+// Blocked Bloom filter. A key sets a few bits within one 64-byte block, so
+// a query reads a single cache line. Used in front of `halvesIdx` when
+// there is no `HalfTable`, where most of the probes miss.
+struct BloomFilter {
+    struct alignas(64) Block {
+        uint64_t words[8] = {};
+    };
+    static constexpr size_t bitsPerKey = 16;
+    static constexpr size_t bitsPerBlock = 512;
+    static constexpr size_t hashes = 4;
+
+    std::vector<Block> blocks;
+    size_t blockShift;
+    size_t capacity;
+
+    explicit BloomFilter(size_t minCapacity = 1024) {
+        size_t numBlocks = 1;
+        size_t log = 0;
+        while (numBlocks * bitsPerBlock < minCapacity * bitsPerKey) {
+            numBlocks *= 2;
+            ++log;
+        }
+        blocks.resize(numBlocks);
+        blockShift = 64 - log;
+        capacity = numBlocks * bitsPerBlock / bitsPerKey;
+    }
+
+    static uint64_t hash(Shape shape) {
+        uint64_t h = shape.fold() * 0x9e3779b97f4a7c15ull;
+        return h ^ (h >> 29);
+    }
+
+    size_t blockIdx(uint64_t h) const {
+        // shifting a 64-bit value by 64 is undefined
+        return blockShift == 64 ? 0 : h >> blockShift;
+    }
+
+    void insert(Shape shape) {
+        uint64_t h = hash(shape);
+        Block& b = blocks[blockIdx(h)];
+        for (size_t i = 0; i < hashes; ++i) {
+            size_t bit = (h >> (i * 9)) % bitsPerBlock;
+            b.words[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+    }
+
+    bool mayContain(Shape shape) const {
+        uint64_t h = hash(shape);
+        const Block& b = blocks[blockIdx(h)];
+        for (size_t i = 0; i < hashes; ++i) {
+            size_t bit = (h >> (i * 9)) % bitsPerBlock;
+            if (!(b.words[bit / 64] & (uint64_t(1) << (bit % 64)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void clear() {
+        std::fill(blocks.begin(), blocks.end(), Block{});
+    }
+};
+
+// Direct-mapped cache of `collapse()` for west halves, which is the
+// expensive part of `cut()`. Many shapes share the same west half. An
+// entry packs the west cells of the input and of the result into one
+// 64-bit word, so it is read and written atomically without locks, and
+// shared by all the threads. With up to 22 bits per half, every half has
+// its own entry and the cache never misses twice.
+struct CollapseCache {
+    using T = Shape::T;
+    static constexpr size_t PART = Shape::PART;
+    static constexpr size_t LAYER = Shape::LAYER;
+    static constexpr size_t bits = LAYER * PART;
+    static constexpr bool enabled = 2 * bits + 1 <= 64;
+    static constexpr size_t maxLogSize = 22;
+    static constexpr size_t logSize = std::min(bits, maxLogSize);
+    static constexpr uint64_t valid = uint64_t(1) << 63;
+    // calls counted by a thread before they are added to the totals
+    static constexpr uint64_t publishEvery = 4096;
+
+    std::vector<std::atomic<uint64_t>> entries =
+        std::vector<std::atomic<uint64_t>>(enabled ? size_t(1) << logSize : 0);
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+
+    Shape cut(Shape shape) {
+        Shape west = shape.westHalf();
+        if constexpr (!enabled) {
+            return west.collapse();
+        } else {
+            uint64_t key = pack(west);
+            size_t idx = bits <= maxLogSize ? key
+                : mix64(key) >> (64 - logSize);
+            uint64_t entry = entries[idx].load(std::memory_order_relaxed);
+            bool hit = (entry & valid) && (entry & mask(bits)) == key;
+            count(hit);
+            if (hit) {
+                return unpack((entry & ~valid) >> bits);
+            }
+            Shape ret = west.collapse();
+            entries[idx].store(valid | (pack(ret) << bits) | key,
+                               std::memory_order_relaxed);
+            return ret;
+        }
+    }
+
+    static constexpr uint64_t mask(size_t n) {
+        return (uint64_t(1) << n) - 1;
+    }
+
+    // The west cells are the low PART bits of each layer
+    static uint64_t pack(Shape half) {
+        uint64_t ret = 0;
+        for (size_t layer = 0; layer < LAYER; ++layer) {
+            ret |= uint64_t(half.value >> (2 * PART * layer) & mask(PART))
+                << (PART * layer);
+        }
+        return ret;
+    }
+
+    static Shape unpack(uint64_t packed) {
+        T ret = 0;
+        for (size_t layer = 0; layer < LAYER; ++layer) {
+            ret |= T(packed >> (PART * layer) & mask(PART))
+                << (2 * PART * layer);
+        }
+        return Shape(ret);
+    }
+
+    void count(bool hit) {
+        thread_local uint64_t localHits = 0;
+        thread_local uint64_t localCalls = 0;
+        localHits += hit;
+        if (++localCalls == publishEvery) {
+            hits.fetch_add(localHits, std::memory_order_relaxed);
+            misses.fetch_add(localCalls - localHits,
+                             std::memory_order_relaxed);
+            localHits = 0;
+            localCalls = 0;
+        }
+    }
+};
+
 // Enumerates all the possible shapes
 // We classify shapes into two categories
 // 1) There is a method to construct it that the last step is a swapping
@@ -76,27 +328,100 @@ struct Searcher {
     constexpr static size_t PART = Shape::PART;
     constexpr static size_t LAYER = Shape::LAYER;
 
+    template <typename K>
+    using TrackedSet = ska::bytell_hash_set<K, std::hash<K>, std::equal_to<K>,
+                                            TrackedAllocator<K>>;
+    template <typename K, typename V>
+    using TrackedMap = ska::bytell_hash_map<
+        K, V, std::hash<K>, std::equal_to<K>,
+        TrackedAllocator<std::pair<K, V>>>;
+
+    // Memory of the containers below, counted by their allocators.
+    // `pairing` is the temporary sets of `pairHalves()`.
+    struct Memory {
+        MemoryAccount shapes;
+        MemoryAccount queueSet;
+        MemoryAccount queue;
+        MemoryAccount halvesIdx;
+        MemoryAccount quarters;
+        MemoryAccount pairing;
+
+        size_t total() const {
+            return shapes.bytes + queueSet.bytes + queue.bytes
+                + halvesIdx.bytes + quarters.bytes + pairing.bytes;
+        }
+    };
+    // charged from const methods too
+    mutable Memory memory;
+
     // all the possible shapes in the second category
-    ska::bytell_hash_set<Shape> shapes;
+    ShapeTable shapes{&memory.shapes};
     // all the possible halves
     std::vector<Shape> halves;
     // reverse mapping for `halves`
-    ska::bytell_hash_map<Shape, size_t> halvesIdx;
+    TrackedMap<Shape, size_t> halvesIdx{
+        TrackedAllocator<std::pair<Shape, size_t>>(&memory.halvesIdx)};
+    // same as `halvesIdx`, indexed by the columns of the halves
+    HalfTable halfTable;
+    // prefilter for `halvesIdx` when there is no `halfTable`
+    BloomFilter halvesFilter;
+    // shared by the threads that expand shapes
+    mutable CollapseCache collapseCache;
     // all the possible quarters
-    ska::bytell_hash_set<Shape> quarters;
+    TrackedSet<Shape> quarters{TrackedAllocator<Shape>(&memory.quarters)};
     // queue for BFS searching. Because a shape can't be easily removed
     // in the middle of deque, a hash set is used to record all the
     // shapes that haven't be removed.
-    std::deque<Shape> queue;
-    ska::bytell_hash_set<Shape> queueSet;
+    ShapeQueue queue{&memory.queue};
+    ShapeTable queueSet{&memory.queueSet};
     // the next half to be processed
     size_t nextHalf = 0;
+    // Shapes to be enqueued, which are not combinable. They are inserted
+    // in batches, so that the hash table slots can be prefetched ahead of
+    // the inserts. The order is kept, so the BFS order is not affected.
+    std::vector<Shape> pending;
+    static constexpr size_t batchSize = 256;
+    // the shapes of `pending`, to find a paired shape that is still pending
+    BloomFilter pendingFilter{batchSize};
+    static constexpr size_t prefetchDistance = 16;
 
     // All the possible connected shapes that consist of pins and regular
     // shapes. They cover all the cases for stacking another shape on top
     // of this shape. Stacking of more complex shapes can be achieved by
     // stacking these simple shapes multiple times
     std::vector<Shape> singleLayerShapes;
+    // [t][i]: index of `transform(singleLayerShapes[i], t)`
+    std::array<std::vector<size_t>, 2 * PART> pieceImage;
+
+    // Number of threads used by the parallel parts of the search
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::unique_ptr<WorkStealingPool> pool;
+    // Halves pairs below this are not worth another thread
+    static constexpr size_t minPairsPerChunk = 1024;
+    // Shapes taken from the queue at a time, and expanded in parallel
+    static constexpr size_t frontierSize = 1 << 14;
+    static constexpr size_t expandGrain = 64;
+
+    // Maximum number of successors of a shape: stacking each of
+    // `singleLayerShapes`, pin pusher and crystal generator
+    static constexpr size_t maxSuccessors = PART * PART + 1 + 2;
+
+    // Everything `process()` needs to know about a shape. It only depends
+    // on the shape, so it is computed ahead, for many shapes in parallel.
+    // Results that the symmetry of the shape makes equal to an earlier one
+    // are left out.
+    struct Expansion {
+        // number of distinct shapes obtained by rotation and flip
+        size_t variants;
+        size_t numQuarters = 0;
+        std::array<Shape, PART> quarters;
+        // canonical halves obtained by cutting
+        size_t numCuts = 0;
+        std::array<Shape, PART> cuts;
+        // canonical shapes made from this shape in one step
+        size_t numSuccessors = 0;
+        std::array<Shape, maxSuccessors> successors;
+    };
 
     // Total number of shapes explored
     size_t count = 0;
@@ -104,6 +429,60 @@ struct Searcher {
     static constexpr size_t perLogCount = 10000000;
     size_t nextLogCount = perLogCount;
 
+    // Periodic checkpoint of the search state. The snapshot is written by a
+    // forked child from its copy-on-write view of the memory, so the search
+    // itself only pauses for the fork.
+    std::string checkpointPath;
+    std::chrono::seconds checkpointInterval{600};
+    std::chrono::steady_clock::time_point nextCheckpoint =
+        std::chrono::steady_clock::now() + checkpointInterval;
+    pid_t checkpointWriter = -1;
+    // Whether the state has been restored from a checkpoint
+    bool resumed = false;
+
+    // Where the counters and timers of `SearchStats` are written, as JSON,
+    // periodically and at the end
+    std::string statsPath;
+    std::chrono::seconds statsInterval{60};
+    std::chrono::steady_clock::time_point nextStats =
+        std::chrono::steady_clock::now() + statsInterval;
+    // Progress records are written to this file descriptor as JSON lines,
+    // every `progressInterval`. A SIGUSR1 writes a record with all the
+    // stats, to stderr if there is no progress stream.
+    int progressFd = -1;
+    std::chrono::seconds progressInterval{10};
+    std::chrono::steady_clock::time_point nextProgress;
+    std::chrono::steady_clock::time_point lastProgress;
+    size_t lastProgressCount = 0;
+    uint64_t lastProgressProcessed = 0;
+    static inline volatile std::sig_atomic_t statsRequested = 0;
+    const std::chrono::steady_clock::time_point startTime =
+        std::chrono::steady_clock::now();
+
+    // A warning is printed when the memory of the containers may exceed
+    // this many bytes at the next growth of a table. 0 for no limit.
+    size_t memLimit = 0;
+    // bucket counts of the tables at the last warning
+    size_t memWarnedSlots = 0;
+
+    // Where the timeline of `Trace` is written at the end, if enabled
+    std::string tracePath;
+
+    // Hardware counters of the whole search, and of the two phases of the
+    // main loop with the shapes explored in them, with `--perf`
+    bool perfEnabled = false;
+    PerfCounters perf;
+    PerfCounters::Values perfPairing{};
+    PerfCounters::Values perfDraining{};
+    size_t pairingShapes = 0;
+    size_t drainingShapes = 0;
+
+    // Set when this is one process of a partitioned search. The process
+    // only keeps the shapes it owns, and sends the other successors to
+    // their owners. All the processes know all the halves, but may find
+    // them in different orders, which doesn't change the result.
+    PartitionPeer* peer = nullptr;
+
     Searcher() {
         // Init singleLayerShapes
         for (size_t part = 0; part < PART; ++part) {
@@ -126,45 +505,168 @@ struct Searcher {
         for (Shape& shape : singleLayerShapes) {
             shape.value <<= 2 * PART * (LAYER - 1);
         }
+        // The pieces are closed under rotation and flip
+        for (size_t t = 0; t < 2 * PART; ++t) {
+            for (Shape piece : singleLayerShapes) {
+                auto it = std::find(singleLayerShapes.begin(),
+                                    singleLayerShapes.end(),
+                                    transform(piece, t));
+                pieceImage[t].push_back(it - singleLayerShapes.begin());
+            }
+        }
+    }
+
+    // The t-th of the shapes obtained by rotation and flip: rotate by t for
+    // t < PART, otherwise rotate by t - PART and flip
+    static constexpr Shape transform(Shape shape, size_t t) {
+        return t < PART ? shape.rotate(t) : shape.rotate(t - PART).flip();
     }
 
     // Whether a shape can be constructed by swapping two halves.
     // Only halves with index less than lastHalf is considered.
     bool combinable(Shape shape,
                     std::optional<size_t> lastHalf = std::nullopt) const {
+        size_t limit = lastHalf.value_or(~size_t(0));
+        if constexpr (HalfTable::enabled) {
+            // unknown halves are `none`, which is never below the limit
+            uint32_t limit32 = std::min<size_t>(limit, HalfTable::none);
+            // twice around, so that every half is consecutive
+            uint32_t columns[2 * PART];
+            for (size_t part = 0; part < PART; ++part) {
+                columns[part] = columns[part + PART] = shape.column(part);
+            }
+            for (size_t angle = 0; angle < PART / 2; ++angle) {
+                uint32_t left = halfTable.find(&columns[angle]);
+                if (left >= limit32) {
+                    continue;
+                }
+                uint32_t right = halfTable.find(&columns[angle + PART / 2]);
+                if (right < limit32) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
         constexpr T mask = repeat<T>(repeat<T>(3, 2, PART / 2), 2 * PART,
                                      LAYER);
         for (size_t angle = 0; angle < PART / 2; ++angle) {
-            Shape left{shape.rotate(angle).value & mask};
-            Shape right{shape.rotate(angle + PART / 2).value & mask};
-            left = left.equivalentHalves()[0];
-            right = right.equivalentHalves()[0];
-            auto itLeft = halvesIdx.find(left);
-            if (itLeft == halvesIdx.end()) {
+            Shape left = Shape{shape.rotate(angle).value & mask}
+                .canonicalHalf();
+            Shape right = Shape{shape.rotate(angle + PART / 2).value & mask}
+                .canonicalHalf();
+            if (!halvesFilter.mayContain(left) ||
+                    !halvesFilter.mayContain(right)) {
                 continue;
             }
-            auto itRight = halvesIdx.find(right);
-            if (itRight == halvesIdx.end()) {
+            auto itLeft = halvesIdx.find(left);
+            if (itLeft == halvesIdx.end() || itLeft->second >= limit) {
                 continue;
             }
-            if (!lastHalf.has_value() ||
-                itLeft->second < *lastHalf && itRight->second < *lastHalf) {
+            auto itRight = halvesIdx.find(right);
+            if (itRight != halvesIdx.end() && itRight->second < limit) {
                 return true;
             }
         }
         return false;
     }
 
+    // Record a half in canonical form. Returns false if it is already known
+    bool addHalf(Shape half) {
+        if (!halvesIdx.emplace(half, halves.size()).second) {
+            return false;
+        }
+        SearchStats::add(SearchStats::HALVES_FOUND);
+        if constexpr (HalfTable::enabled) {
+            halfTable.add(half, halves.size());
+        } else if (halves.size() < halvesFilter.capacity) {
+            halvesFilter.insert(half);
+        } else {
+            // rebuild with twice the capacity
+            halvesFilter = BloomFilter(halvesFilter.capacity * 2);
+            for (Shape other : halves) {
+                halvesFilter.insert(other);
+            }
+            halvesFilter.insert(half);
+        }
+        halves.push_back(half);
+        return true;
+    }
+
     // Search all the possible shapes.
     // We always process the shapes in the first category first.
     void run() {
+        // before the threads are created, so they are counted
+        if (perfEnabled && !perf.open()) {
+            std::cerr << "Hardware counters are not available" << std::endl;
+        }
+        PerfCounters::Values perfTotal{};
+        size_t startCount = count;
+        {
+            PerfCounters::Scope perfScope{perf, perfTotal};
+            pool = std::make_unique<WorkStealingPool>(threads);
+            if (!resumed) {
+                init();
+            }
+            loop();
+        }
+        if (!statsPath.empty()) {
+            SearchStats::instance().write(statsPath);
+        }
+        if (!tracePath.empty()) {
+            Trace::instance().write(tracePath);
+        }
+        if (progressFd >= 0) {
+            writeProgress(progressFd, std::format("{{\"type\": \"done\", {}}}",
+                    progress(std::chrono::steady_clock::now())));
+        }
+
+        // The timing of the workers varies from run to run. Keep it out of
+        // stdout, which is the same for any number of threads.
+        const auto& stats = pool->stats();
+        for (size_t id = 0; id < stats.size() && stats.size() > 1; ++id) {
+            std::chrono::duration<double> idle = stats[id].idle;
+            std::cerr << std::format("Worker {}: {} tasks, {} steals, "
+                    "{:.1f}s idle", id, stats[id].tasks, stats[id].steals,
+                    idle.count()) << std::endl;
+        }
+        std::cerr << std::format("Huge pages: {} MB of 1 GB pages, {} MB of "
+                "2 MB pages, {} MB advised, {} MB transparent",
+                HugePageArena::gigaBytes >> 20, HugePageArena::hugeBytes >> 20,
+                HugePageArena::advisedBytes >> 20,
+                HugePageArena::transparentBytes() >> 20) << std::endl;
+        if constexpr (CollapseCache::enabled) {
+            uint64_t hits = collapseCache.hits;
+            uint64_t calls = hits + collapseCache.misses;
+            std::cerr << std::format("Cut cache: {} hits of {} calls "
+                    "({:.1f}%)", hits, calls, calls ? 100.0 * hits / calls : 0.)
+                << std::endl;
+        }
+        if (perf.enabled()) {
+            std::cerr << "Perf pairing: " << perf.report(perfPairing,
+                    pairingShapes, "shape") << std::endl;
+            std::cerr << "Perf draining: " << perf.report(perfDraining,
+                    drainingShapes, "shape") << std::endl;
+            std::cerr << "Perf total: " << perf.report(perfTotal,
+                    count - startCount, "shape") << std::endl;
+        }
+    }
+
+    // Find the quarters, and pre-calculate the halves made from them
+    void init() {
         ConservativeQuadSearcher quadSearcher;
-        quadSearcher.run();
+        {
+            SearchStats::Scope scope{SearchStats::QUAD_SEARCH};
+            Trace::Span span{"quad_search"};
+            quadSearcher.run();
+        }
         std::cout << std::format("Found {} quarters",
                 quadSearcher.quads.size()) << std::endl;
 
         // Estimate possible halves
         if constexpr (PART == 4) {
+            SearchStats::Scope scope{SearchStats::HALVES_PRECALC};
+            Trace::Span span{"halves_precalc"};
             std::vector<Shape> quads{quadSearcher.quads.begin(),
                                      quadSearcher.quads.end()};
             size_t numQuads = quads.size();
@@ -180,76 +682,637 @@ struct Searcher {
                     idx /= numQuads;
                     half = half | Shape(quads[quad].value << (2 * part));
                 }
-                half = half.collapse();
-                half = half.equivalentHalves()[0];
-                if (halvesIdx.emplace(half, halves.size()).second) {
-                    halves.push_back(half);
-                }
+                half = collapseCache.cut(half);
+                addHalf(half.canonicalHalf());
             }
             std::cout << std::format("Pre-calculated {} halves", halves.size())
                 << std::endl;
+        } else if constexpr (PART == 6) {
+            SearchStats::Scope scope{SearchStats::HALVES_PRECALC};
+            Trace::Span span{"halves_precalc"};
+            precalcHexHalves({quadSearcher.quads.begin(),
+                              quadSearcher.quads.end()});
+            std::cout << std::format("Pre-calculated {} halves", halves.size())
+                << std::endl;
         } else {
             // I don't know if all the shapes generated by the code above can
             // be made when PART > 4. Therefore, take a conservative approach
-            halvesIdx.emplace(Shape(), 0);
-            halves.push_back(Shape());
+            addHalf(Shape());
         }
+    }
 
-        while (!queue.empty() || nextHalf < halves.size()) {
-            if (nextHalf < halves.size()) {
-                auto variants = halves[nextHalf].equivalentHalves();
-                for (auto& shape : variants) {
-                    shape = shape.rotate(PART / 2);
+    // With PART == 6 a half is three quarters. Putting them side by side and
+    // collapsing, as for PART == 4, may keep a middle quarter that needs
+    // both of its neighbours to stay up, which no sequence of cuts keeps.
+    // Instead, follow the two ways to build A, B, C with the swapper: put A
+    // next to B and cut, then put C next to B; or B next to C, then A next
+    // to B. Each quarter comes with the other parts filled, as the quad
+    // searcher made it, and each cut collapses what it keeps.
+    void precalcHexHalves(const std::vector<Shape>& quads) {
+        constexpr T quadMask = repeat<T>(3, 2 * PART, LAYER);
+        auto west = [&](Shape shape) {
+            return collapseCache.cut(shape);
+        };
+        auto east = [&](Shape shape) {
+            return collapseCache.cut(shape.rotate(PART / 2)).rotate(PART / 2);
+        };
+        // the half with the quarter at part 2, or the east half with it at
+        // part 3, so that swapping them puts the two quarters side by side
+        std::vector<Shape> westOf;
+        std::vector<Shape> eastOf;
+        for (Shape quad : quads) {
+            Shape fill{~quadMask
+                & repeat<T>(T(Type::Shape), 2, PART * quad.layers())};
+            westOf.push_back(west((quad | fill).rotate(PART - 2)));
+            eastOf.push_back(east((quad | fill).rotate(PART - 3)));
+        }
+
+        // The pairs X, Y cut next to Y, as a west half with Y at part 2,
+        // and cut next to X, as an east half with X at part 3
+        std::vector<Shape> leftPairs;
+        std::vector<Shape> rightPairs;
+        ska::bytell_hash_set<Shape> seenLeft;
+        ska::bytell_hash_set<Shape> seenRight;
+        for (Shape x : westOf) {
+            for (Shape y : eastOf) {
+                Shape pair = x | y;
+                Shape left = west(pair.rotate(1));
+                if (seenLeft.insert(left).second) {
+                    leftPairs.push_back(left);
                 }
-                // Swap this new half with existing halves to create a new
-                // shape.
-                ska::bytell_hash_set<Shape> temp;
-                for (size_t i = 0; i <= nextHalf; ++i) {
-                    auto other = halves[i];
+                Shape right = east(pair.rotate(PART - 1));
+                if (seenRight.insert(right).second) {
+                    rightPairs.push_back(right);
+                }
+            }
+        }
+
+        // The triples, in parallel, added in a fixed order
+        auto addAll = [&](const std::vector<Shape>& pairs, auto&& triple) {
+            if (pairs.empty()) {
+                return;
+            }
+            size_t numChunks = std::min(threads * 8, pairs.size());
+            size_t chunkSize = (pairs.size() + numChunks - 1) / numChunks;
+            std::vector<std::vector<Shape>> chunks(numChunks);
+            pool->parallelFor(numChunks, 1, [&](size_t begin, size_t end) {
+                for (size_t c = begin; c < end; ++c) {
+                    ska::bytell_hash_set<Shape> seen;
+                    size_t last = std::min(pairs.size(), (c + 1) * chunkSize);
+                    for (size_t i = c * chunkSize; i < last; ++i) {
+                        for (size_t q = 0; q < quads.size(); ++q) {
+                            Shape half = triple(pairs[i], q).canonicalHalf();
+                            if (seen.insert(half).second) {
+                                chunks[c].push_back(half);
+                            }
+                        }
+                    }
+                }
+            });
+            for (const auto& chunk : chunks) {
+                for (Shape half : chunk) {
+                    addHalf(half);
+                }
+            }
+        };
+        addAll(leftPairs, [&](Shape pair, size_t c) {
+            return west((pair | eastOf[c]).rotate(1));
+        });
+        addAll(rightPairs, [&](Shape pair, size_t a) {
+            return west((westOf[a] | pair).rotate(2));
+        });
+    }
+
+    // Swap the given half with all the halves up to itself. Returns the new
+    // shapes that can't be made with earlier halves, in canonical form,
+    // without duplicates, and in the order of a serial loop over the halves.
+    // This only reads the search state, so the pairs are split into chunks
+    // and checked in parallel. Each chunk is deduplicated locally, and the
+    // chunks are merged in order.
+    std::vector<Shape> pairHalves(size_t half) const {
+        SearchStats::Scope scope{SearchStats::PAIR_HALVES};
+        Trace::Span span{"pair_halves", half};
+        auto variants = halves[half].equivalentHalves();
+        for (auto& shape : variants) {
+            shape = shape.rotate(PART / 2);
+        }
+
+        size_t total = half + 1;
+        size_t numChunks = std::min(
+                threads * 8, (total + minPairsPerChunk - 1) / minPairsPerChunk);
+        size_t chunkSize = (total + numChunks - 1) / numChunks;
+        TrackedAllocator<Shape> allocator(&memory.pairing);
+        std::vector<std::vector<Shape, TrackedAllocator<Shape>>> chunks(
+                numChunks, std::vector<Shape, TrackedAllocator<Shape>>(
+                        allocator));
+        pool->parallelFor(numChunks, 1, [&](size_t begin, size_t end) {
+            Trace::Span span{"pair_chunk", end - begin};
+            for (size_t c = begin; c < end; ++c) {
+                TrackedSet<Shape> seen{allocator};
+                size_t last = std::min(total, (c + 1) * chunkSize);
+                for (size_t i = c * chunkSize; i < last; ++i) {
                     for (Shape a : variants) {
-                        Shape combined = a | other;
-                        if (combinable(combined, nextHalf)) {
+                        Shape combined = a | halves[i];
+                        if (combinable(combined, half)) {
                             continue;
                         }
-                        Shape shape = combined.equivalentShapes()[0];
-                        if (temp.emplace(shape).second) {
-                            if (auto it = queueSet.find(shape);
-                                    it != queueSet.end()) {
-                                // We thought the shape is in category two,
-                                // but it's actually is in category one. We
-                                // haven't processed the shape yet, so
-                                // remove the shape from the queue and
-                                // process it immediately.
-                                queueSet.erase(it);
-                                shapes.erase(shape);
-                                process(shape);
-                            } else if (auto it = shapes.find(shape);
-                                    it != shapes.end()) {
-                                // We thought the shape is in category two,
-                                // but it's actually is in category one. We
-                                // have processed the shape, so only remove
-                                // the shape from category two, and don't
-                                // process it again.
-                                shapes.erase(it);
-                            } else {
-                                process(shape);
-                            }
+                        Shape shape = combined.canonical();
+                        if (!owns(shape)) {
+                            continue;
+                        }
+                        if (seen.emplace(shape).second) {
+                            chunks[c].push_back(shape);
                         }
                     }
                 }
-                ++nextHalf;
-            } else {
-                Shape shape = queue.front();
-                queue.pop_front();
-                if (auto it = queueSet.find(shape); it != queueSet.end()) {
-                    queueSet.erase(it);
-                    process(shape);
+            }
+        });
+
+        std::vector<Shape> ret;
+        TrackedSet<Shape> seen{allocator};
+        for (const auto& chunk : chunks) {
+            for (Shape shape : chunk) {
+                if (seen.emplace(shape).second) {
+                    ret.push_back(shape);
                 }
             }
         }
+        return ret;
+    }
+
+    // Expand the shapes in parallel
+    void expandAll(const std::vector<Shape>& batch,
+                   std::vector<Expansion>& expansions) const {
+        SearchStats::Scope scope{SearchStats::EXPAND};
+        Trace::Span span{"expand", batch.size()};
+        expansions.resize(batch.size());
+        pool->parallelFor(batch.size(), expandGrain,
+                [&](size_t begin, size_t end) {
+            Trace::Span span{"expand_chunk", end - begin};
+            for (size_t i = begin; i < end; ++i) {
+                expansions[i] = expand(batch[i]);
+            }
+        });
+    }
+
+    // The shapes are expanded in parallel, but processed one by one in the
+    // same order as a serial search, so the result doesn't depend on the
+    // number of threads.
+    void loop() {
+        auto handler = [this](PartitionMessage::Kind kind,
+                              std::span<const Shape> received) {
+            receive(kind, received);
+        };
+        do {
+            step(handler);
+        } while (peer && waitForWork(handler));
 
         queue.shrink_to_fit();
         queueSet.shrink_to_fit();
+
+        if (checkpointWriter > 0) {
+            reapCheckpointWriter(true);
+        }
+    }
+
+    // Returns false when the whole partitioned search is done
+    bool waitForWork(const PartitionPeer::Handler& handler) {
+        Trace::Span span{"wait_for_work"};
+        // an idle process still answers SIGUSR1 and writes its records
+        return peer->waitForWork(handler, [this] {
+            maybeWriteStats();
+            maybeWriteProgress();
+        });
+    }
+
+    // Run until there is no local work
+    void step(const PartitionPeer::Handler& handler) {
+        std::vector<Shape> batch;
+        std::vector<Expansion> expansions;
+        while (!queue.empty() || !pending.empty()
+                || nextHalf < halves.size()) {
+            maybeCheckpoint();
+            maybeWriteStats();
+            maybeWriteProgress();
+            checkMemory();
+            if (peer) {
+                peer->exchange(handler);
+            }
+            if (nextHalf < halves.size()) {
+                // Swap this new half with existing halves to create a new
+                // shape. Most of them are new, so expand all of them.
+                SearchStats::Scope scope{SearchStats::PAIR_EXPANSION};
+                Trace::Span span{"pair_expansion", nextHalf};
+                PerfCounters::Scope perfScope{perf, perfPairing};
+                size_t startCount = count;
+                batch = pairHalves(nextHalf);
+                SearchStats::add(SearchStats::PAIRED, batch.size());
+                expandAll(batch, expansions);
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    Shape shape = batch[i];
+                    // The shape may have been enqueued by an earlier
+                    // `process()` and still be pending. If it's new, the
+                    // insert would only make it found in `queueSet` below
+                    // and processed now, so it's dropped instead of
+                    // flushing the batch for every paired shape.
+                    dropPending(shape);
+                    if (auto it = queueSet.find(shape);
+                            it != queueSet.end()) {
+                        // We thought the shape is in category two, but it's
+                        // actually is in category one. We haven't processed
+                        // the shape yet, so remove the shape from the queue
+                        // and process it immediately.
+                        queueSet.erase(it);
+                        shapes.erase(shape);
+                        SearchStats::add(SearchStats::RECLASSIFIED_QUEUED);
+                        process(expansions[i]);
+                    } else if (auto it = shapes.find(shape);
+                            it != shapes.end()) {
+                        // We thought the shape is in category two, but it's
+                        // actually is in category one. We have processed
+                        // the shape, so only remove the shape from category
+                        // two, and don't process it again.
+                        shapes.erase(it);
+                        SearchStats::add(SearchStats::RECLASSIFIED_PROCESSED);
+                    } else {
+                        process(expansions[i]);
+                    }
+                }
+                pairingShapes += count - startCount;
+                ++nextHalf;
+            } else {
+                if (queue.empty()) {
+                    flush();
+                    continue;
+                }
+                // Take a batch from the front of the queue
+                SearchStats::Scope scope{SearchStats::QUEUE_DRAIN};
+                Trace::Span span{"queue_drain", queue.size()};
+                PerfCounters::Scope perfScope{perf, perfDraining};
+                size_t startCount = count;
+                batch.clear();
+                while (batch.size() < frontierSize && !queue.empty()) {
+                    Shape shape = queue.front();
+                    queue.pop_front();
+                    if (queueSet.find(shape) != queueSet.end()) {
+                        batch.push_back(shape);
+                    }
+                }
+                expandAll(batch, expansions);
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    if (nextHalf < halves.size()) {
+                        // A new half must be paired before the rest of the
+                        // batch is processed. Put them back to the queue.
+                        for (size_t j = batch.size(); j-- > i;) {
+                            queue.push_front(batch[j]);
+                        }
+                        break;
+                    }
+                    if (auto it = queueSet.find(batch[i]);
+                            it != queueSet.end()) {
+                        queueSet.erase(it);
+                        process(expansions[i]);
+                    }
+                }
+                drainingShapes += count - startCount;
+            }
+        }
+    }
+
+    // Handle a message from another process of a partitioned search
+    void receive(PartitionMessage::Kind kind, std::span<const Shape> received) {
+        for (Shape shape : received) {
+            if (kind == PartitionMessage::HALVES) {
+                addHalf(shape);
+            } else {
+                enqueue(shape);
+            }
+        }
+    }
+
+    bool owns(Shape shape) const {
+        return !peer || peer->owner(shape) == peer->id;
+    }
+
+    // The result of a process of a partitioned search: `count`, and then
+    // each container as a 64-bit size followed by the raw shapes
+    void sendResult(int fd) const {
+        auto writeShapes = [&](const auto& container) {
+            std::vector<Shape> all{container.begin(), container.end()};
+            uint64_t size = all.size();
+            writeAll(fd, &size, sizeof(size));
+            writeAll(fd, all.data(), size * sizeof(Shape));
+        };
+        uint64_t value = count;
+        writeAll(fd, &value, sizeof(value));
+        writeShapes(halves);
+        writeShapes(quarters);
+        writeShapes(shapes);
+    }
+
+    void mergeResult(int fd) {
+        auto readShapes = [&](auto&& insert) {
+            uint64_t size = 0;
+            readAll(fd, &size, sizeof(size));
+            std::vector<Shape> all(size);
+            readAll(fd, all.data(), size * sizeof(Shape));
+            for (Shape shape : all) {
+                insert(shape);
+            }
+        };
+        uint64_t value = 0;
+        readAll(fd, &value, sizeof(value));
+        count += value;
+        readShapes([&](Shape shape) { addHalf(shape); });
+        readShapes([&](Shape shape) { quarters.insert(shape); });
+        readShapes([&](Shape shape) { shapes.insert(shape); });
+    }
+
+    // Checkpoint file layout: magic, LAYER, PART, the counters, and then
+    // each container as a 64-bit size followed by the raw shapes. `halves`
+    // and `queue` are stored in order, which `halvesIdx` and the BFS rely on.
+    static constexpr char checkpointMagic[8] = {
+        'S', 'Z', '2', 'C', 'K', 'P', 'T', '1'};
+
+    void saveCheckpoint(const std::string& filename) const {
+        using namespace std;
+        ofstream file{filename, ios::out | ios::binary | ios::trunc};
+        auto writeValue = [&](uint64_t value) {
+            file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        };
+        auto writeShapes = [&](const auto& container) {
+            writeValue(container.size());
+            for (Shape shape : container) {
+                file.write(reinterpret_cast<const char*>(&shape),
+                           sizeof(shape));
+            }
+        };
+        file.write(checkpointMagic, sizeof(checkpointMagic));
+        writeValue(LAYER);
+        writeValue(PART);
+        writeValue(count);
+        writeValue(nextLogCount);
+        writeValue(nextHalf);
+        writeShapes(halves);
+        writeShapes(quarters);
+        writeShapes(shapes);
+        writeShapes(queueSet);
+        writeValue(queue.size());
+        queue.forEach([&](Shape shape) {
+            file.write(reinterpret_cast<const char*>(&shape), sizeof(shape));
+        });
+        file.flush();
+        if (!file) {
+            throw std::runtime_error("failed to write checkpoint");
+        }
+    }
+
+    void loadCheckpoint(const std::string& filename) {
+        using namespace std;
+        ifstream file{filename, ios::in | ios::binary};
+        auto readValue = [&]() {
+            uint64_t value = 0;
+            file.read(reinterpret_cast<char*>(&value), sizeof(value));
+            return value;
+        };
+        // Read the shapes in chunks, to avoid a second full copy in memory
+        auto readShapes = [&](auto&& insert) {
+            uint64_t size = readValue();
+            std::vector<Shape> chunk;
+            while (size > 0 && file) {
+                chunk.resize(std::min<uint64_t>(size, 1 << 16));
+                file.read(reinterpret_cast<char*>(chunk.data()),
+                          chunk.size() * sizeof(Shape));
+                for (Shape shape : chunk) {
+                    insert(shape);
+                }
+                size -= chunk.size();
+            }
+        };
+        char magic[sizeof(checkpointMagic)] = {};
+        file.read(magic, sizeof(magic));
+        if (!std::equal(magic, magic + sizeof(magic), checkpointMagic)) {
+            throw std::runtime_error("not a checkpoint file");
+        }
+        if (readValue() != LAYER || readValue() != PART) {
+            throw std::runtime_error("checkpoint is for another config");
+        }
+        count = readValue();
+        nextLogCount = readValue();
+        nextHalf = readValue();
+        readShapes([&](Shape shape) { addHalf(shape); });
+        readShapes([&](Shape shape) { quarters.insert(shape); });
+        readShapes([&](Shape shape) { shapes.insert(shape); });
+        readShapes([&](Shape shape) { queueSet.insert(shape); });
+        readShapes([&](Shape shape) { queue.push_back(shape); });
+        if (!file) {
+            throw std::runtime_error("truncated checkpoint");
+        }
+        resumed = true;
+    }
+
+    // Write a checkpoint if one is due. Only called between two steps of
+    // the main loop, where the state is consistent.
+    void maybeCheckpoint() {
+        if (checkpointPath.empty()) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (now < nextCheckpoint) {
+            return;
+        }
+        SearchStats::Scope scope{SearchStats::CHECKPOINT};
+        Trace::Span span{"checkpoint"};
+        flush();
+        // The previous snapshot is still being written
+        if (checkpointWriter > 0 && !reapCheckpointWriter(false)) {
+            return;
+        }
+        nextCheckpoint = now + checkpointInterval;
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            int status = 0;
+            try {
+                writeCheckpoint();
+            } catch (...) {
+                status = 1;
+            }
+            _exit(status);
+        } else if (pid < 0) {
+            // Can't fork, write it in the foreground
+            writeCheckpoint();
+        } else {
+            checkpointWriter = pid;
+        }
+    }
+
+    void maybeWriteStats() {
+        if (statsPath.empty()) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (now < nextStats) {
+            return;
+        }
+        nextStats = now + statsInterval;
+        SearchStats::instance().write(statsPath);
+    }
+
+    void maybeWriteProgress() {
+        auto now = std::chrono::steady_clock::now();
+        if (statsRequested) {
+            statsRequested = 0;
+            writeProgress(progressFd >= 0 ? progressFd : STDERR_FILENO,
+                          std::format("{{\"type\": \"stats\", {}, "
+                                      "\"stats\": {}}}", progress(now),
+                                      SearchStats::instance().json()));
+        }
+        if (progressFd < 0 || now < nextProgress) {
+            return;
+        }
+        nextProgress = now + progressInterval;
+        writeProgress(progressFd, std::format("{{\"type\": \"progress\", {}}}",
+                                              progress(now)));
+    }
+
+    // The fields of a progress record. The rates are since the last record.
+    // The ETA is the time to drain the current queue at the current rate,
+    // so it grows when pairing new halves adds shapes.
+    std::string progress(std::chrono::steady_clock::time_point now) {
+        uint64_t processed =
+            SearchStats::instance().total(SearchStats::PROCESSED);
+        std::chrono::duration<double> elapsed = now - startTime;
+        std::chrono::duration<double> interval = now - lastProgress;
+        double rate = 0;
+        double processedRate = 0;
+        if (lastProgress != std::chrono::steady_clock::time_point()
+                && interval.count() > 0) {
+            rate = (count - lastProgressCount) / interval.count();
+            processedRate = (processed - lastProgressProcessed)
+                / interval.count();
+        }
+        std::string eta = "null";
+        if (processedRate > 0) {
+            eta = std::format("{:.0f}", queueSet.size() / processedRate);
+        }
+        lastProgress = now;
+        lastProgressCount = count;
+        lastProgressProcessed = processed;
+        return std::format("\"partition\": {}, \"elapsed\": {:.1f}, "
+                "\"count\": {}, \"quarters\": {}, \"next_half\": {}, "
+                "\"halves\": {}, \"queued\": {}, \"queue\": {}, "
+                "\"shapes\": {}, \"rss\": {}, \"tracked\": {}, "
+                "\"rate\": {:.0f}, "
+                "\"processed_rate\": {:.0f}, \"eta\": {}",
+                peer ? peer->id : 0, elapsed.count(), count, quarters.size(),
+                nextHalf, halves.size(), queueSet.size(), queue.size(),
+                shapes.size(), residentBytes(), memory.total(), rate,
+                processedRate, eta);
+    }
+
+    // Growing a table allocates the new slots before the old ones are
+    // freed, so the peak is ahead of the current memory by twice the
+    // biggest table
+    void checkMemory() {
+        if (memLimit == 0) {
+            return;
+        }
+        size_t growth = 2 * std::max(shapes.bytes(), queueSet.bytes());
+        size_t projected = memory.total() + growth;
+        size_t slots = shapes.bucket_count() + queueSet.bucket_count();
+        if (projected <= memLimit || slots == memWarnedSlots) {
+            return;
+        }
+        memWarnedSlots = slots;
+        std::cerr << std::format("Warning: projected peak of {:.1f} MB "
+                "exceeds --mem-limit of {:.1f} MB. {}", projected / 1048576.,
+                memLimit / 1048576., memoryLine()) << std::endl;
+    }
+
+    // The memory of all the containers, in one line
+    std::string memoryLine() const {
+        return std::format("Memory: {} MB tracked (shapes {}, queueSet {}, "
+                "queue {}, halvesIdx {}, quarters {}, pairing {}), {} MB "
+                "resident", memory.total() >> 20, memory.shapes.bytes >> 20,
+                memory.queueSet.bytes >> 20, memory.queue.bytes >> 20,
+                memory.halvesIdx.bytes >> 20, memory.quarters.bytes >> 20,
+                memory.pairing.bytes >> 20, residentBytes() >> 20);
+    }
+
+    // For each container: the entries, the slots and the load factor of the
+    // tables, and the bytes allocated now and at most
+    void printMemory() const {
+        auto print = [&](std::string_view name, const MemoryAccount& account,
+                         std::optional<size_t> size,
+                         std::optional<size_t> slots) {
+            std::string entries;
+            if (size) {
+                entries = std::format("{} entries, ", *size);
+            }
+            if (slots) {
+                entries += std::format("{} slots, load factor {:.2f}, ", *slots,
+                                       *slots ? double(*size) / *slots : 0.);
+            }
+            std::cout << std::format("# memory of {}: {}{} bytes (peak {})",
+                    name, entries, account.bytes.load(), account.peak.load())
+                << std::endl;
+        };
+        print("shapes", memory.shapes, shapes.size(), shapes.bucket_count());
+        print("queueSet", memory.queueSet, queueSet.size(),
+              queueSet.bucket_count());
+        print("queue", memory.queue, queue.size(), std::nullopt);
+        print("halvesIdx", memory.halvesIdx, halvesIdx.size(),
+              halvesIdx.bucket_count());
+        print("quarters", memory.quarters, quarters.size(),
+              quarters.bucket_count());
+        print("pairing", memory.pairing, std::nullopt, std::nullopt);
+    }
+
+    // A line is written with a single write, so the records of the
+    // processes of a partitioned search don't interleave on a pipe
+    void writeProgress(int fd, std::string record) {
+        record += '\n';
+        try {
+            writeAll(fd, record.data(), record.size());
+        } catch (const std::exception&) {
+            std::cerr << "Failed to write progress, stopping it" << std::endl;
+            if (fd == progressFd) {
+                progressFd = -1;
+            }
+        }
+    }
+
+    static size_t residentBytes() {
+        std::ifstream file{"/proc/self/statm"};
+        size_t pages = 0;
+        size_t resident = 0;
+        file >> pages >> resident;
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+
+    // Write to a temporary file first, so that a crash while writing never
+    // leaves a broken checkpoint behind
+    void writeCheckpoint() const {
+        std::string temp = checkpointPath + ".tmp";
+        saveCheckpoint(temp);
+        if (std::rename(temp.c_str(), checkpointPath.c_str()) != 0) {
+            throw std::runtime_error("failed to rename checkpoint");
+        }
+    }
+
+    // Returns false if the writer is still running and `block` is false
+    bool reapCheckpointWriter(bool block) {
+        int status = 0;
+        pid_t pid = waitpid(checkpointWriter, &status, block ? 0 : WNOHANG);
+        if (pid == 0) {
+            return false;
+        }
+        if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            std::cerr << "Failed to write checkpoint" << std::endl;
+        }
+        checkpointWriter = -1;
+        return true;
     }
 
     void summarize() const {
@@ -258,69 +1321,343 @@ struct Searcher {
         std::cout << "# shapes whose halves aren't stable: " << shapes.size()
             << std::endl;
         std::cout << "# quarters: " << quarters.size() << std::endl;
+        std::cout << std::format("# digest: {:016x}", digest()) << std::endl;
+        printMemory();
     }
 
-    void process(Shape shape) {
-        std::vector<Shape> variants = shape.equivalentShapes();
-        count += variants.size();
+    // Fingerprint of the result, to compare runs with different number of
+    // threads or processes without comparing the dumps. The containers are
+    // hashed regardless of their order: a partitioned search finds the same
+    // halves in another order.
+    uint64_t digest() const {
+        uint64_t sum = 0;
+        for (Shape half : halves) {
+            sum += mix64(mix64(half.fold()));
+        }
+        for (Shape shape : shapes) {
+            sum += mix64(shape.fold());
+        }
+        for (Shape quarter : quarters) {
+            sum += mix64(~quarter.fold());
+        }
+        return mix64(count ^ sum);
+    }
+
+    Expansion expand(Shape shape) const {
+        Expansion ret;
+        SearchStats::add(SearchStats::EXPANDED);
+
+        // The rotations and flips that keep the shape unchanged. If g is one
+        // of them, the results of rotation `angle` and `angle + g`, or of
+        // stacking `piece` and `g(piece)`, are the same up to g.
+        std::array<size_t, 2 * PART> stabilizer;
+        size_t order = 0;
+        for (size_t t = 0; t < 2 * PART; ++t) {
+            if (transform(shape, t) == shape) {
+                stabilizer[order++] = t;
+            }
+        }
+        ret.variants = 2 * PART / order;
+        // Whether a symmetric rotation leads to an earlier angle
+        auto repeatedAngle = [&](size_t angle) {
+            for (size_t i = 0; i < order && stabilizer[i] < PART; ++i) {
+                if ((angle + stabilizer[i]) % PART < angle) {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        // unique quarter
+        for (size_t angle = 0; angle < PART; ++angle) {
+            constexpr T mask = repeat<T>(3, 2 * PART, LAYER);
+            if (!repeatedAngle(angle)) {
+                ret.quarters[ret.numQuarters++] = shape.rotate(angle) & mask;
+            }
+        }
+
+        // cut
+        SearchStats::Lap lap;
+        for (size_t angle = 0; angle < PART; ++angle) {
+            if (!repeatedAngle(angle)) {
+                ret.cuts[ret.numCuts++] =
+                    collapseCache.cut(shape.rotate(angle)).canonicalHalf();
+            }
+        }
+        lap.split(SearchStats::CUT);
+
+        // stack, skipping the pieces that a symmetry maps to an earlier one
+        for (size_t p = 0; p < singleLayerShapes.size(); ++p) {
+            bool repeated = false;
+            for (size_t i = 1; i < order && !repeated; ++i) {
+                repeated = pieceImage[stabilizer[i]][p] < p;
+            }
+            if (!repeated) {
+                ret.successors[ret.numSuccessors++] =
+                    shape.stack(singleLayerShapes[p]).canonical();
+            }
+        }
+        lap.split(SearchStats::STACK);
+        // pin pusher
+        ret.successors[ret.numSuccessors++] = shape.pin().canonical();
+        lap.split(SearchStats::PIN);
+        // crystal generator
+        ret.successors[ret.numSuccessors++] = shape.crystalize().canonical();
+        lap.split(SearchStats::CRYSTAL);
+        return ret;
+    }
+
+    void process(const Expansion& expansion) {
+        // once per shape, so sampled like the steps of an expansion
+        SearchStats::Lap lap;
+        SearchStats::add(SearchStats::PROCESSED);
+        count += expansion.variants;
         if (count >= nextLogCount) {
             nextLogCount += perLogCount;
             std::cout << std::format("Processed {} shapes, {} quarters, "
                     "{}/{} halves, {}/{}/{} shapes", count, quarters.size(),
                     nextHalf, halves.size(), queueSet.size(), queue.size(),
                     shapes.size()) << std::endl;
+            std::cerr << memoryLine() << std::endl;
         }
 
         // record unique quarter
-        for (size_t angle = 0; angle < PART; ++angle) {
-            constexpr T mask = repeat<T>(3, 2 * PART, LAYER);
-            quarters.insert(shape.rotate(angle) & mask);
+        for (size_t i = 0; i < expansion.numQuarters; ++i) {
+            quarters.insert(expansion.quarters[i]);
         }
 
         // cut
-        for (size_t angle = 0; angle < PART; ++angle) {
-            Shape cut = shape.rotate(angle).cut().equivalentHalves()[0];
-            if (halvesIdx.find(cut) != halvesIdx.end()) {
-                continue;
+        for (size_t i = 0; i < expansion.numCuts; ++i) {
+            Shape half = expansion.cuts[i];
+            if (addHalf(half) && peer) {
+                peer->broadcastHalf(half);
             }
-            halvesIdx[cut] = halves.size();
-            halves.push_back(cut);
         }
 
-        // stack
-        for (Shape piece : singleLayerShapes) {
-            enqueue(shape.stack(piece));
+        for (size_t i = 0; i < expansion.numSuccessors; ++i) {
+            enqueue(expansion.successors[i]);
         }
-
-        // pin pusher
-        enqueue(shape.pin());
-
-        // crystal generator
-        enqueue(shape.crystalize());
+        lap.split(SearchStats::PROCESS);
     }
 
+    // Enqueue a shape in canonical form. Being combinable doesn't depend on
+    // rotation and flip.
     void enqueue(Shape shape) {
         if (combinable(shape)) {
+            SearchStats::add(SearchStats::ENQUEUE_COMBINABLE);
             return;
         }
+        if (!owns(shape)) {
+            SearchStats::add(SearchStats::ENQUEUE_REMOTE);
+            peer->sendShape(peer->owner(shape), shape);
+            return;
+        }
+        SearchStats::add(SearchStats::ENQUEUE_KEPT);
+        pending.push_back(shape);
+        pendingFilter.insert(shape);
+        if (pending.size() >= batchSize) {
+            flush();
+        }
+    }
 
-        shape = shape.equivalentShapes()[0];
+    // Insert the pending shapes, with the slots prefetched a few shapes
+    // ahead.
+    void flush() {
+        if (pending.empty()) {
+            return;
+        }
+        SearchStats::Scope scope{SearchStats::FLUSH};
+        size_t inserted = 0;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            if (i + prefetchDistance < pending.size()) {
+                shapes.prefetch(pending[i + prefetchDistance]);
+            }
+            Shape shape = pending[i];
+            if (shapes.emplace(shape).second) {
+                queue.push_back(shape);
+                queueSet.insert(shape);
+                ++inserted;
+            }
+        }
+        SearchStats::add(SearchStats::INSERT_NEW, inserted);
+        SearchStats::add(SearchStats::INSERT_KNOWN, pending.size() - inserted);
+        pending.clear();
+        pendingFilter.clear();
+    }
 
-        if (shapes.emplace(shape).second){
-            queue.push_back(shape);
-            queueSet.insert(shape);
+    void dropPending(Shape shape) {
+        if (pendingFilter.mayContain(shape)) {
+            std::erase(pending, shape);
         }
     }
 };
 
-}
-
-int main(int argc, char* argv[]) {
+// Built once per config; shapez.cpp picks one at runtime
+int searchMain(int argc, char* argv[]) {
+    // The tables of the searcher take their first memory when it's
+    // constructed, so the arena has to know before
+    for (int i = 1; i < argc; ++i) {
+        if (std::string_view(argv[i]) == "--no-huge-pages") {
+            Shapez::HugePageArena::enabled = false;
+        }
+    }
     Shapez::Searcher searcher;
-    searcher.run();
+    std::string dump;
+    bool resume = false;
+    size_t partitions = 0;
+    std::string numa = "off";
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--checkpoint" && i + 1 < argc) {
+            searcher.checkpointPath = argv[++i];
+        } else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+            searcher.checkpointInterval = std::chrono::seconds(
+                    std::stoul(argv[++i]));
+            searcher.nextCheckpoint = std::chrono::steady_clock::now()
+                + searcher.checkpointInterval;
+        } else if (arg == "--stats" && i + 1 < argc) {
+            searcher.statsPath = argv[++i];
+        } else if (arg == "--stats-interval" && i + 1 < argc) {
+            searcher.statsInterval = std::chrono::seconds(
+                    std::stoul(argv[++i]));
+            searcher.nextStats = std::chrono::steady_clock::now()
+                + searcher.statsInterval;
+        } else if (arg == "--progress-fd" && i + 1 < argc) {
+            searcher.progressFd = std::stoi(argv[++i]);
+        } else if (arg == "--progress-interval" && i + 1 < argc) {
+            searcher.progressInterval = std::chrono::seconds(
+                    std::stoul(argv[++i]));
+        } else if (arg == "--mem-limit" && i + 1 < argc) {
+            // in MB, or with a suffix G
+            std::string_view limit = argv[++i];
+            size_t shift = limit.ends_with('G') ? 30 : 20;
+            searcher.memLimit = std::stoul(std::string(limit)) << shift;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            searcher.tracePath = argv[++i];
+            Shapez::Trace::enable();
+        } else if (arg == "--perf") {
+            searcher.perfEnabled = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            searcher.threads = std::max(1ul, std::stoul(argv[++i]));
+        } else if (arg == "--partitions" && i + 1 < argc) {
+            partitions = std::max(1ul, std::stoul(argv[++i]));
+        } else if (arg == "--numa" && i + 1 < argc) {
+            numa = argv[++i];
+        } else if (arg == "--no-huge-pages") {
+            // taken before the searcher was constructed
+        } else if (arg == "--resume") {
+            resume = true;
+        } else if (!arg.starts_with("--") && dump.empty()) {
+            dump = arg;
+        } else {
+            std::cout << "Usage: search [--checkpoint file] "
+                "[--checkpoint-interval seconds] [--resume] [--stats file] "
+                "[--stats-interval seconds] [--progress-fd fd] "
+                "[--progress-interval seconds] [--mem-limit MB] "
+                "[--trace file] [--perf] "
+                "[--threads n] [--partitions n] [--numa off|bind|interleave] "
+                "[--no-huge-pages] [dump.bin]"
+                << std::endl;
+            return 1;
+        }
+    }
+
+    // The handler only sets a flag, which the main loop polls. SA_RESTART
+    // keeps the blocking calls of the search from failing with EINTR.
+    struct sigaction action{};
+    action.sa_handler = [](int) {
+        Shapez::Searcher::statsRequested = 1;
+    };
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, nullptr);
+    // A monitor that goes away shouldn't kill the search
+    if (searcher.progressFd >= 0) {
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    // With `bind`, the search is partitioned with at least one process per
+    // node, and each process and its tables stay on one node. Successors
+    // owned by another node are forwarded in batches instead of probed
+    // remotely. `interleave` spreads the tables of a single process over
+    // all the nodes.
+    Shapez::NumaTopology topology = Shapez::NumaTopology::detect();
+    if (numa != "off" && numa != "bind" && numa != "interleave") {
+        std::cout << "--numa must be off, bind or interleave" << std::endl;
+        return 1;
+    }
+    if (numa == "bind" && topology.size() < 2) {
+        std::cout << "Only one NUMA node, falling back to interleave"
+            << std::endl;
+        numa = "interleave";
+    }
+    if (partitions == 0) {
+        partitions = numa == "bind" ? topology.size() : 1;
+    }
+    if (numa == "interleave" && !topology.interleave()) {
+        std::cout << "Failed to interleave memory" << std::endl;
+    }
+
+    if (resume) {
+        if (searcher.checkpointPath.empty()) {
+            std::cout << "--resume requires --checkpoint" << std::endl;
+            return 1;
+        }
+        searcher.loadCheckpoint(searcher.checkpointPath);
+        std::cout << std::format("Resumed from {} shapes, {}/{} halves",
+                searcher.count, searcher.nextHalf, searcher.halves.size())
+            << std::endl;
+    }
+
+    if (partitions > 1 && !searcher.checkpointPath.empty()) {
+        std::cout << "--partitions doesn't support --checkpoint" << std::endl;
+        return 1;
+    }
+
+    if (partitions > 1) {
+        // The processes share the threads
+        size_t threads = std::max(1ul, searcher.threads / partitions);
+        Shapez::PartitionCoordinator coordinator(partitions,
+                [&](Shapez::PartitionPeer& peer, int up) {
+            // Only the first process reports its progress
+            if (peer.id != 0) {
+                std::cout.setstate(std::ios::badbit);
+            }
+            if (numa == "bind"
+                    && !topology.bind(peer.id % topology.size())) {
+                std::cerr << "Failed to bind to NUMA node" << std::endl;
+            }
+            searcher.peer = &peer;
+            searcher.threads = threads;
+            // Each process writes its own stats and trace
+            if (!searcher.statsPath.empty()) {
+                searcher.statsPath += std::format(".{}", peer.id);
+            }
+            if (!searcher.tracePath.empty()) {
+                searcher.tracePath += std::format(".{}", peer.id);
+            }
+            searcher.run();
+            searcher.sendResult(up);
+        });
+        // A stats request to this process goes to all the processes
+        coordinator.wait([&] {
+            if (Shapez::Searcher::statsRequested) {
+                Shapez::Searcher::statsRequested = 0;
+                coordinator.signal(SIGUSR1);
+            }
+        });
+        for (size_t i = 0; i < partitions; ++i) {
+            searcher.mergeResult(coordinator.up(i));
+        }
+        if (!coordinator.join()) {
+            std::cout << "A partition failed" << std::endl;
+            return 1;
+        }
+    } else {
+        searcher.run();
+    }
     searcher.summarize();
 
-    if (argc >= 2) {
+    if (!dump.empty()) {
         Shapez::ShapeSet set;
         set.halves.insert(set.halves.end(), searcher.halves.begin(),
                           searcher.halves.end());
@@ -328,7 +1665,15 @@ int main(int argc, char* argv[]) {
                           searcher.shapes.end());
         std::sort(set.halves.begin(), set.halves.end());
         std::sort(set.shapes.begin(), set.shapes.end());
-        set.save(argv[1]);
+        set.save(dump);
     }
     return 0;
 }
+
+}
+
+#ifndef SHAPEZ_NO_MAIN
+int main(int argc, char* argv[]) {
+    return Shapez::searchMain(argc, argv);
+}
+#endif
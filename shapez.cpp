@@ -0,0 +1,134 @@
+#include <format>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "shapez.hpp"
+
+// The configs built into the tool, as X(layers, parts). The Makefile builds
+// search.cpp and lookup.cpp once for each of them (SHAPEZ_CONFIGS), each in
+// its own namespace, so every config keeps its constant-folded hot paths.
+#define SHAPEZ_CONFIGS(X) X(4, 4) X(5, 4) X(4, 6)
+
+namespace Shapez {
+
+#define X(layer, part) \
+    namespace SHAPEZ_CONFIG_NAME(layer, part) { \
+        int searchMain(int argc, char* argv[]); \
+        int lookupMain(int argc, char* argv[]); \
+    }
+SHAPEZ_CONFIGS(X)
+#undef X
+
+struct Config {
+    size_t layers;
+    size_t parts;
+    int (*search)(int argc, char* argv[]);
+    int (*lookup)(int argc, char* argv[]);
+};
+
+#define X(layer, part) \
+    Config{layer, part, SHAPEZ_CONFIG_NAME(layer, part)::searchMain, \
+           SHAPEZ_CONFIG_NAME(layer, part)::lookupMain},
+constexpr Config configs[] = {SHAPEZ_CONFIGS(X)};
+#undef X
+
+const Config* findConfig(size_t layers, size_t parts) {
+    for (const Config& config : configs) {
+        if (config.layers == layers && config.parts == parts) {
+            return &config;
+        }
+    }
+    return nullptr;
+}
+
+int usage() {
+    std::cout << "Usage: shapez search [--layers n] [--parts n] "
+        "[search options]\n"
+        "       shapez lookup [--layers n] [--parts n] [--perf] dump.bin "
+        "shape\n"
+        "lookup takes the config from the dump when it has a header.\n"
+        "Configs:";
+    for (const Config& config : configs) {
+        std::cout << std::format(" {}x{}", config.layers, config.parts);
+    }
+    std::cout << std::endl;
+    return 1;
+}
+
+int run(int argc, char* argv[]) {
+    if (argc < 2) {
+        return usage();
+    }
+    std::string_view command = argv[1];
+    if (command != "search" && command != "lookup") {
+        return usage();
+    }
+
+    // The arguments of the command, without the config
+    std::optional<size_t> layers;
+    std::optional<size_t> parts;
+    std::vector<char*> args{argv[1]};
+    std::string dump;
+    for (int i = 2; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--layers" && i + 1 < argc) {
+            layers = std::stoul(argv[++i]);
+        } else if (arg == "--parts" && i + 1 < argc) {
+            parts = std::stoul(argv[++i]);
+        } else {
+            if (command == "lookup" && !arg.starts_with("--")
+                    && dump.empty()) {
+                dump = arg;
+            }
+            args.push_back(argv[i]);
+        }
+    }
+    args.push_back(nullptr);
+
+    // A lookup takes the config of its dump. The flags are only needed for
+    // dumps without a header, and are checked by the load otherwise.
+    if (command == "lookup" && !layers && !parts && !dump.empty()) {
+        if (auto header = DumpHeader::read(dump)) {
+            layers = header->layers;
+            parts = header->parts;
+        } else {
+            std::cout << "The dump has no header, give --layers and --parts"
+                << std::endl;
+            return 1;
+        }
+    }
+    const Config* config = findConfig(layers.value_or(CONFIG_LAYER),
+                                      parts.value_or(CONFIG_PART));
+    if (!config) {
+        std::cout << std::format("{}x{} is not built in",
+                layers.value_or(CONFIG_LAYER), parts.value_or(CONFIG_PART))
+            << std::endl;
+        return usage();
+    }
+
+    int n = args.size() - 1;
+    if (command == "search") {
+        return config->search(n, args.data());
+    }
+    return config->lookup(n, args.data());
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    using namespace Shapez;
+
+    try {
+        return run(argc, argv);
+    } catch (const std::runtime_error& e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    } catch (const std::logic_error&) {
+        // a number that doesn't parse, or is out of range
+        return usage();
+    }
+}
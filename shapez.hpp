@@ -1,7 +1,10 @@
+#pragma once
+
 #include <algorithm>
 #include <array>
 #include <cstdint>
 #include <fstream>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -16,10 +19,19 @@
 #define CONFIG_PART 4
 #endif
 
+// Everything that depends on the config lives in a namespace named after
+// it, e.g. Shapez::Config4x4, which is inline so that it reads as Shapez.
+// Translation units built with different configs can then be linked into
+// one binary, see shapez.cpp.
+#define SHAPEZ_CONFIG_NAME(layer, part) Config##layer##x##part
+#define SHAPEZ_CONFIG_NAME_OF(layer, part) SHAPEZ_CONFIG_NAME(layer, part)
+#define SHAPEZ_CONFIG SHAPEZ_CONFIG_NAME_OF(CONFIG_LAYER, CONFIG_PART)
 
 namespace Shapez {
 
 using std::size_t;
+// For the configs with more than 64 bits, such as 5 layers of 8 parts
+__extension__ typedef unsigned __int128 uint128_t;
 
 // The type of the shape at each cell.
 // Color doesn't matter, because
@@ -68,6 +80,55 @@ constexpr T repeat(T val, size_t width, size_t count) {
     return ret;
 }
 
+// Finalizer of splitmix64. Spreads the bits of a shape, which are very
+// uneven, over the whole 64 bits.
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Dumps start with a magic and the LAYER and PART they are for, as
+// checkpoints do. Older dumps have no header.
+struct DumpHeader {
+    static constexpr char magic[8] = {'S', 'Z', '2', 'D', 'U', 'M', 'P', '1'};
+
+    uint64_t layers = 0;
+    uint64_t parts = 0;
+
+    void write(std::ostream& file) const {
+        file.write(magic, sizeof(magic));
+        file.write(reinterpret_cast<const char*>(&layers), sizeof(layers));
+        file.write(reinterpret_cast<const char*>(&parts), sizeof(parts));
+    }
+
+    // Without a header, the file is left at its start
+    static std::optional<DumpHeader> read(std::istream& file) {
+        char buffer[sizeof(magic)] = {};
+        file.read(buffer, sizeof(buffer));
+        if (!file || !std::equal(buffer, buffer + sizeof(buffer), magic)) {
+            file.clear();
+            file.seekg(0);
+            return std::nullopt;
+        }
+        DumpHeader ret;
+        file.read(reinterpret_cast<char*>(&ret.layers), sizeof(ret.layers));
+        file.read(reinterpret_cast<char*>(&ret.parts), sizeof(ret.parts));
+        return ret;
+    }
+
+    static std::optional<DumpHeader> read(const std::string& filename) {
+        std::ifstream file{filename, std::ios::in | std::ios::binary};
+        return read(file);
+    }
+};
+
+}
+
+namespace Shapez::inline SHAPEZ_CONFIG {
+
 // A shape.
 // This is a compact array. Each element occupies 2 bits (the size of Type).
 // The first index is layer; the second index is the part in the layer.
@@ -79,11 +140,23 @@ struct Shape {
     // parts in each layer
     constexpr static size_t PART = CONFIG_PART;
 
-    static_assert(LAYER * LAYER * 2 <= 64);
-    using T = std::conditional_t<LAYER * PART * 2 <= 32, uint32_t, uint64_t>;
+    static_assert(LAYER * PART * 2 <= 128);
+    using T = std::conditional_t<LAYER * PART * 2 <= 32, uint32_t,
+          std::conditional_t<LAYER * PART * 2 <= 64, uint64_t, uint128_t>>;
 
     T value = 0;
 
+    // The value in 64 bits, for hashing with `mix64`. The same as the value
+    // when it fits.
+    constexpr uint64_t fold() const {
+        if constexpr (sizeof(T) <= sizeof(uint64_t)) {
+            return value;
+        } else {
+            return uint64_t(value)
+                ^ uint64_t(value >> 64) * 0x9e3779b97f4a7c15ull;
+        }
+    }
+
     constexpr Type get(size_t layer, size_t part) const {
         size_t idx = layer * PART + part;
         return Type((value >> (idx * 2)) & T(3));
@@ -390,8 +463,8 @@ struct Shape {
         return Shape(ret);
     }
 
-    // Cut the shape. Returns the west half
-    constexpr Shape cut() const {
+    // The west half when the shape is cut, before gravity is applied
+    constexpr Shape westHalf() const {
         // mask of the west half
         constexpr T mask = repeat<T>(repeat<T>(3, 2, PART / 2), 2 * PART,
                                      LAYER);
@@ -399,8 +472,13 @@ struct Shape {
         Shape ret = breakCrystals<~mask>();
         // remove everything in the east half
         ret.value &= mask;
+        return ret;
+    }
+
+    // Cut the shape. Returns the west half
+    constexpr Shape cut() const {
         // apply gravity
-        return ret.collapse();
+        return westHalf().collapse();
     }
 
     // Apply pin pusher
@@ -439,6 +517,16 @@ struct Shape {
         return Shape(value & ~(pin & ~keepPin));
     }
 
+    // The smallest of `equivalentShapes()`, without allocation
+    constexpr Shape canonical() const {
+        Shape ret = *this;
+        for (size_t angle = 0; angle < PART; ++angle) {
+            Shape rotated = rotate(angle);
+            ret = std::min({ret, rotated, rotated.flip()});
+        }
+        return ret;
+    }
+
     // All the shapes that can be obtained by rotation and flip
     std::vector<Shape> equivalentShapes() const {
         std::vector<Shape> ret;
@@ -452,6 +540,22 @@ struct Shape {
         return ret;
     }
 
+    // The cells of one part across all the layers, packed into 2 * LAYER
+    // bits with the bottom layer in the lowest bits
+    constexpr uint32_t column(size_t part) const {
+        uint32_t ret = 0;
+        for (size_t layer = 0; layer < LAYER; ++layer) {
+            size_t idx = layer * PART + part;
+            ret |= uint32_t((value >> (idx * 2)) & T(3)) << (layer * 2);
+        }
+        return ret;
+    }
+
+    // The smallest of `equivalentHalves()`, without allocation
+    constexpr Shape canonicalHalf() const {
+        return std::min(*this, flip().rotate(PART / 2));
+    }
+
     // All the halves that can be obtained by flip
     std::vector<Shape> equivalentHalves() const {
         Shape flipped = flip().rotate(PART / 2);
@@ -472,6 +576,7 @@ struct ShapeSet {
     void save(const std::string& filename) const {
         using namespace std;
         ofstream file{filename, ios::out | ios::binary | ios::trunc};
+        DumpHeader{Shape::LAYER, Shape::PART}.write(file);
         uint32_t size = halves.size();
         file.write(reinterpret_cast<const char*>(&size), sizeof(size));
         file.write(reinterpret_cast<const char*>(halves.data()),
@@ -486,6 +591,15 @@ struct ShapeSet {
         using namespace std;
         ShapeSet ret;
         ifstream file{filename, ios::in | ios::binary};
+        // Dumps without a header are taken to be of this config
+        auto header = DumpHeader::read(file);
+        if (header && (header->layers != Shape::LAYER
+                       || header->parts != Shape::PART)) {
+            throw runtime_error("dump is for " + to_string(header->layers)
+                    + "x" + to_string(header->parts) + " shapes, not "
+                    + to_string(Shape::LAYER) + "x"
+                    + to_string(Shape::PART));
+        }
         uint32_t size;
         file.read(reinterpret_cast<char*>(&size), sizeof(size));
         ret.halves.resize(size);
@@ -504,6 +618,6 @@ struct ShapeSet {
 template <>
 struct std::hash<Shapez::Shape> {
     std::size_t operator()(const Shapez::Shape& shape) const noexcept {
-        return shape.value;
+        return shape.fold();
     }
 };
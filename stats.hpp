@@ -0,0 +1,260 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace Shapez {
+
+// Cheap timestamp: the TSC where there is one
+inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Counters and timers of the search. Each thread adds to its own slot, so
+// counting is a plain add in a cache line no other thread writes. The
+// slots are summed when the stats are written, which only happens between
+// the parallel loops.
+class SearchStats {
+public:
+    enum Counter {
+        // shapes expanded, and applied to the search state
+        EXPANDED,
+        PROCESSED,
+        // successors dropped because they are combinable, sent to the
+        // process that owns them, or kept
+        ENQUEUE_COMBINABLE,
+        ENQUEUE_REMOTE,
+        ENQUEUE_KEPT,
+        // kept successors that are new, or already known
+        INSERT_NEW,
+        INSERT_KNOWN,
+        // new shapes made by pairing halves
+        PAIRED,
+        // paired shapes that were thought to be in category two, before or
+        // after being processed
+        RECLASSIFIED_QUEUED,
+        RECLASSIFIED_PROCESSED,
+        HALVES_FOUND,
+        NUM_COUNTERS,
+    };
+
+    enum Timer {
+        QUAD_SEARCH,
+        HALVES_PRECALC,
+        // a round of pairing a new half: pairing, expanding and processing
+        PAIR_EXPANSION,
+        // a batch from the queue: expanding and processing
+        QUEUE_DRAIN,
+        // finding the new shapes of a half
+        PAIR_HALVES,
+        // expanding a batch in parallel, as seen by the main thread
+        EXPAND,
+        // the steps of an expansion, summed over the threads
+        CUT,
+        STACK,
+        PIN,
+        CRYSTAL,
+        // applying an expansion to the search state
+        PROCESS,
+        FLUSH,
+        CHECKPOINT,
+        NUM_TIMERS,
+    };
+
+    static constexpr const char* counterNames[NUM_COUNTERS] = {
+        "expanded", "processed", "enqueue_combinable", "enqueue_remote",
+        "enqueue_kept", "insert_new", "insert_known", "paired",
+        "reclassified_queued", "reclassified_processed", "halves_found",
+    };
+
+    static constexpr const char* timerNames[NUM_TIMERS] = {
+        "quad_search", "halves_precalc", "pair_expansion", "queue_drain",
+        "pair_halves", "expand", "cut", "stack", "pin", "crystal",
+        "process", "flush", "checkpoint",
+    };
+
+private:
+    struct alignas(64) Slot {
+        std::array<uint64_t, NUM_COUNTERS> counters{};
+        std::array<uint64_t, NUM_TIMERS> ticks{};
+        std::array<uint64_t, NUM_TIMERS> calls{};
+        // calls that were timed
+        std::array<uint64_t, NUM_TIMERS> samples{};
+        uint64_t laps = 0;
+    };
+
+public:
+    // One in this many laps is timed
+    static constexpr uint64_t lapSampling = 16;
+
+    static SearchStats& instance() {
+        static SearchStats stats;
+        return stats;
+    }
+
+    static void add(Counter counter, uint64_t n = 1) {
+        local().counters[counter] += n;
+    }
+
+    static void addTicks(Timer timer, uint64_t n) {
+        Slot& slot = local();
+        slot.ticks[timer] += n;
+        ++slot.calls[timer];
+        ++slot.samples[timer];
+    }
+
+    // Times the enclosing scope
+    class Scope {
+    public:
+        explicit Scope(Timer timer) : timer(timer), start(ticks()) {}
+        ~Scope() {
+            addTicks(timer, ticks() - start);
+        }
+
+    private:
+        Timer timer;
+        uint64_t start;
+    };
+
+    // Times consecutive sections with one timestamp between two of them:
+    // `split` ends the running section, and starts the next one. For the
+    // short sections of a single shape, where reading the clock costs as
+    // much as a few percent, so only one in `lapSampling` laps is timed,
+    // and the time is scaled to all the calls.
+    class Lap {
+    public:
+        Lap() : slot(local()), sampled(++slot.laps % lapSampling == 0),
+                last(sampled ? ticks() : 0) {}
+
+        void split(Timer timer) {
+            ++slot.calls[timer];
+            if (!sampled) {
+                return;
+            }
+            uint64_t now = ticks();
+            slot.ticks[timer] += now - last;
+            ++slot.samples[timer];
+            last = now;
+        }
+
+    private:
+        Slot& slot;
+        bool sampled;
+        uint64_t last;
+    };
+
+    // A counter summed over the threads
+    uint64_t total(Counter counter) const {
+        std::lock_guard lock{mutex};
+        uint64_t ret = 0;
+        for (const auto& slot : slots) {
+            ret += slot->counters[counter];
+        }
+        return ret;
+    }
+
+    // All the counters and timers so far, as a JSON object
+    std::string json() const {
+        std::array<uint64_t, NUM_COUNTERS> counters{};
+        std::array<uint64_t, NUM_TIMERS> timerTicks{};
+        std::array<uint64_t, NUM_TIMERS> calls{};
+        std::array<uint64_t, NUM_TIMERS> samples{};
+        {
+            std::lock_guard lock{mutex};
+            for (const auto& slot : slots) {
+                for (size_t i = 0; i < NUM_COUNTERS; ++i) {
+                    counters[i] += slot->counters[i];
+                }
+                for (size_t i = 0; i < NUM_TIMERS; ++i) {
+                    timerTicks[i] += slot->ticks[i];
+                    calls[i] += slot->calls[i];
+                    samples[i] += slot->samples[i];
+                }
+            }
+        }
+        // ticks per second, measured since the start
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - startTime;
+        double tickRate = (ticks() - startTicks) / elapsed.count();
+
+        std::string ret = std::format("{{\"elapsed\": {:.3f}, \"counters\": {{",
+                                      elapsed.count());
+        for (size_t i = 0; i < NUM_COUNTERS; ++i) {
+            ret += std::format("{}\"{}\": {}", i ? ", " : "", counterNames[i],
+                               counters[i]);
+        }
+        ret += "}, \"timers\": {";
+        for (size_t i = 0; i < NUM_TIMERS; ++i) {
+            double seconds = timerTicks[i] / tickRate;
+            if (samples[i] > 0) {
+                seconds *= double(calls[i]) / samples[i];
+            }
+            ret += std::format("{}\"{}\": {{\"seconds\": {:.3f}, "
+                               "\"calls\": {}}}", i ? ", " : "", timerNames[i],
+                               seconds, calls[i]);
+        }
+        ret += std::format("}}, \"processed_per_second\": {:.1f}}}",
+                           counters[PROCESSED] / elapsed.count());
+        return ret;
+    }
+
+    // Write to a temporary file first, so that a reader never sees a
+    // partial file
+    void write(const std::string& filename) const {
+        std::string temp = filename + ".tmp";
+        {
+            std::ofstream file{temp, std::ios::out | std::ios::trunc};
+            file << json() << std::endl;
+            if (!file) {
+                throw std::runtime_error("failed to write stats");
+            }
+        }
+        if (std::rename(temp.c_str(), filename.c_str()) != 0) {
+            throw std::runtime_error("failed to rename stats");
+        }
+    }
+
+private:
+    // The slot of the calling thread. Slots live as long as the process,
+    // so the counts of finished threads are kept.
+    static Slot& local() {
+        // not initialized in the declaration, which would add a guard to
+        // every access
+        static thread_local Slot* slot = nullptr;
+        if (!slot) [[unlikely]] {
+            slot = instance().newSlot();
+        }
+        return *slot;
+    }
+
+    Slot* newSlot() {
+        std::lock_guard lock{mutex};
+        slots.push_back(std::make_unique<Slot>());
+        return slots.back().get();
+    }
+
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::chrono::steady_clock::time_point startTime =
+        std::chrono::steady_clock::now();
+    uint64_t startTicks = ticks();
+};
+
+}
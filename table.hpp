@@ -0,0 +1,214 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "arena.hpp"
+#include "memory.hpp"
+#include "shapez.hpp"
+
+namespace Shapez::inline SHAPEZ_CONFIG {
+
+// Hash set of canonical shapes, for the big tables of the searcher.
+// The slots are grouped by cache line, and the groups are probed linearly.
+// Unlike the ska tables, the location of a key can be computed from the
+// outside, so a batch of operations can prefetch all the slots first.
+// Empty and erased slots are marked by two values that are never canonical:
+// all crystals except a shape or a pin in the first part. Rotating such a
+// shape always gives a smaller value.
+class ShapeTable {
+public:
+    using T = Shape::T;
+    static constexpr size_t GROUP = 64 / sizeof(Shape);
+    static constexpr T EMPTY = ~T(0) - 1;
+    static constexpr T ERASED = ~T(0) - 2;
+
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Shape;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Shape*;
+        using reference = const Shape&;
+
+        iterator() = default;
+        iterator(const ShapeTable* table, size_t idx)
+            : table(table), idx(idx) {
+            skip();
+        }
+
+        reference operator*() const { return table->slots[idx]; }
+        pointer operator->() const { return &table->slots[idx]; }
+        iterator& operator++() {
+            ++idx;
+            skip();
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator ret = *this;
+            ++*this;
+            return ret;
+        }
+        bool operator==(const iterator& o) const { return idx == o.idx; }
+
+    private:
+        friend class ShapeTable;
+
+        void skip() {
+            while (idx < table->slots.size() &&
+                   !isKey(table->slots[idx].value)) {
+                ++idx;
+            }
+        }
+
+        const ShapeTable* table = nullptr;
+        size_t idx = 0;
+    };
+
+    // The slots are charged to `account`, if any
+    explicit ShapeTable(MemoryAccount* account = nullptr)
+        : slots(Allocator(account)) {
+        rehash(2);
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t bucket_count() const { return slots.size(); }
+    float load_factor() const { return float(count) / slots.size(); }
+    size_t bytes() const { return slots.capacity() * sizeof(Shape); }
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, slots.size()); }
+
+    // Bring the first group probed for the shape into the cache
+    void prefetch(Shape shape) const {
+        __builtin_prefetch(&slots[groupOf(shape) * GROUP], 1);
+    }
+
+    iterator find(Shape shape) const {
+        for (size_t group = groupOf(shape);; group = (group + 1) & groupMask) {
+            const Shape* base = &slots[group * GROUP];
+            bool hasEmpty = false;
+            for (size_t i = 0; i < GROUP; ++i) {
+                if (base[i] == shape) {
+                    return iterator(this, group * GROUP + i);
+                }
+                hasEmpty |= base[i].value == EMPTY;
+            }
+            if (hasEmpty) {
+                return end();
+            }
+        }
+    }
+
+    std::pair<iterator, bool> emplace(Shape shape) {
+        if ((count + erased + 1) * 16 > slots.size() * 15) {
+            // grow, or only clean up the erased slots
+            size_t groups = slots.size() / GROUP;
+            rehash((count + 1) * 16 > slots.size() * 15 * 3 / 4
+                   ? groups * 2 : groups);
+        }
+        // The first free slot on the probe sequence. The key may still be
+        // anywhere in the group where the probe stops.
+        size_t free = slots.size();
+        for (size_t group = groupOf(shape);; group = (group + 1) & groupMask) {
+            size_t base = group * GROUP;
+            bool hasEmpty = false;
+            for (size_t i = base; i < base + GROUP; ++i) {
+                if (slots[i] == shape) {
+                    return {iterator(this, i), false};
+                }
+                if (!isKey(slots[i].value) && free == slots.size()) {
+                    free = i;
+                }
+                hasEmpty |= slots[i].value == EMPTY;
+            }
+            if (hasEmpty) {
+                break;
+            }
+        }
+        if (slots[free].value == ERASED) {
+            --erased;
+        }
+        slots[free] = shape;
+        ++count;
+        return {iterator(this, free), true};
+    }
+
+    std::pair<iterator, bool> insert(Shape shape) {
+        return emplace(shape);
+    }
+
+    void erase(iterator it) {
+        size_t base = it.idx / GROUP * GROUP;
+        bool hasEmpty = false;
+        for (size_t i = base; i < base + GROUP; ++i) {
+            hasEmpty |= slots[i].value == EMPTY;
+        }
+        // A group that has never been full doesn't continue any probe
+        // sequence, so the slot can be reused as if it was never taken.
+        if (hasEmpty) {
+            slots[it.idx] = Shape(EMPTY);
+        } else {
+            slots[it.idx] = Shape(ERASED);
+            ++erased;
+        }
+        --count;
+    }
+
+    size_t erase(Shape shape) {
+        iterator it = find(shape);
+        if (it == end()) {
+            return 0;
+        }
+        erase(it);
+        return 1;
+    }
+
+    void shrink_to_fit() {
+        size_t groups = 2;
+        while (groups * GROUP * 15 < count * 16) {
+            groups *= 2;
+        }
+        rehash(groups);
+    }
+
+private:
+    static constexpr bool isKey(T value) {
+        return value != EMPTY && value != ERASED;
+    }
+
+    size_t groupOf(Shape shape) const {
+        uint64_t h = std::hash<Shape>()(shape);
+        return (h * 0x9e3779b97f4a7c15ull) >> shift;
+    }
+
+    // Number of groups must be a power of 2, and at least 2
+    void rehash(size_t groups) {
+        Slots old(groups * GROUP, Shape(EMPTY), slots.get_allocator());
+        old.swap(slots);
+        groupMask = groups - 1;
+        shift = 64 - std::countr_zero(groups);
+        count = 0;
+        erased = 0;
+        for (Shape shape : old) {
+            if (isKey(shape.value)) {
+                emplace(shape);
+            }
+        }
+    }
+
+    using Allocator = TrackedAllocator<Shape, HugePageAllocator<Shape>>;
+    using Slots = std::vector<Shape, Allocator>;
+    Slots slots;
+    size_t count = 0;
+    size_t erased = 0;
+    size_t groupMask = 0;
+    size_t shift = 64;
+};
+
+}
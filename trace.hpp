@@ -0,0 +1,146 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "stats.hpp"
+
+namespace Shapez {
+
+// Timeline of a search in the Chrome trace event format, which Perfetto and
+// chrome://tracing open. Each thread records its spans in its own ring
+// buffer, so a long run keeps its last `capacity` spans per thread, and
+// recording a span doesn't lock. Only coarse spans are recorded: phases,
+// rounds of the main loop and the chunks of the parallel loops.
+class Trace {
+public:
+    static constexpr size_t capacity = 1 << 16;
+
+    // Whether spans are recorded
+    static inline std::atomic<bool> enabled = false;
+
+    static Trace& instance() {
+        static Trace trace;
+        return trace;
+    }
+
+    // Start recording. The timeline starts here.
+    static void enable() {
+        instance();
+        enabled = true;
+    }
+
+    // Records the enclosing scope, with an optional number shown with it
+    class Span {
+    public:
+        explicit Span(const char* name, uint64_t arg = 0)
+            : name(enabled.load(std::memory_order_relaxed) ? name : nullptr),
+              arg(arg), start(this->name ? ticks() : 0) {}
+
+        ~Span() {
+            if (name) {
+                local().push({name, arg, start, ticks()});
+            }
+        }
+
+    private:
+        const char* name;
+        uint64_t arg;
+        uint64_t start;
+    };
+
+    void write(const std::string& filename) const {
+        std::lock_guard lock{mutex};
+        std::chrono::duration<double, std::micro> elapsed =
+            std::chrono::steady_clock::now() - startTime;
+        // ticks per microsecond
+        double tickRate = (ticks() - startTicks) / elapsed.count();
+        int pid = getpid();
+
+        std::string temp = filename + ".tmp";
+        {
+            std::ofstream file{temp, std::ios::out | std::ios::trunc};
+            file << "{\"traceEvents\": [";
+            bool first = true;
+            uint64_t dropped = 0;
+            for (size_t tid = 0; tid < rings.size(); ++tid) {
+                const Ring& ring = *rings[tid];
+                size_t size = std::min<uint64_t>(ring.total, capacity);
+                dropped += ring.total - size;
+                // oldest first
+                size_t begin = ring.total > capacity ? ring.next : 0;
+                for (size_t i = 0; i < size; ++i) {
+                    const Event& event = ring.events[(begin + i) % capacity];
+                    file << std::format("{}\n{{\"name\": \"{}\", \"ph\": \"X\", "
+                            "\"pid\": {}, \"tid\": {}, \"ts\": {:.3f}, "
+                            "\"dur\": {:.3f}, \"args\": {{\"n\": {}}}}}",
+                            first ? "" : ",", event.name, pid, tid,
+                            (event.start - startTicks) / tickRate,
+                            (event.end - event.start) / tickRate, event.arg);
+                    first = false;
+                }
+            }
+            file << std::format("\n], \"otherData\": {{\"dropped\": {}}}}}",
+                                dropped) << std::endl;
+            if (!file) {
+                throw std::runtime_error("failed to write trace");
+            }
+        }
+        if (std::rename(temp.c_str(), filename.c_str()) != 0) {
+            throw std::runtime_error("failed to rename trace");
+        }
+    }
+
+private:
+    struct Event {
+        const char* name;
+        uint64_t arg;
+        uint64_t start;
+        uint64_t end;
+    };
+
+    struct Ring {
+        std::vector<Event> events = std::vector<Event>(capacity);
+        size_t next = 0;
+        uint64_t total = 0;
+
+        void push(const Event& event) {
+            events[next] = event;
+            next = (next + 1) % capacity;
+            ++total;
+        }
+    };
+
+    static Ring& local() {
+        static thread_local Ring* ring = nullptr;
+        if (!ring) [[unlikely]] {
+            ring = instance().newRing();
+        }
+        return *ring;
+    }
+
+    Ring* newRing() {
+        std::lock_guard lock{mutex};
+        rings.push_back(std::make_unique<Ring>());
+        return rings.back().get();
+    }
+
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::chrono::steady_clock::time_point startTime =
+        std::chrono::steady_clock::now();
+    uint64_t startTicks = ticks();
+};
+
+}
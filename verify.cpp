@@ -0,0 +1,246 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "reference.hpp"
+#include "shapez.hpp"
+
+namespace Shapez {
+
+// Checks the shape operations against `reference`, on every shape value
+// when there are at most 2^32 of them, and on random samples otherwise.
+// Inputs don't have to be valid shapes: the operations must agree on any
+// value.
+struct Verifier {
+    using T = Shape::T;
+    constexpr static size_t LAYER = Shape::LAYER;
+    constexpr static size_t PART = Shape::PART;
+    constexpr static size_t BITS = 2 * LAYER * PART;
+
+    static constexpr size_t chunkSize = 1 << 20;
+
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    // all the values in [begin, end), or `samples` random ones
+    uint64_t begin = 0;
+    uint64_t end = uint64_t(1) << std::min<size_t>(BITS, 32);
+    bool exhaustive = BITS <= 32;
+    uint64_t samples = uint64_t(1) << 28;
+    uint64_t seed = 1;
+
+    struct Mismatch {
+        const char* op;
+        Shape input;
+        Shape expected;
+        Shape actual;
+    };
+
+    // The first operation that disagrees on a value
+    static std::optional<Mismatch> check(T value) {
+        Shape shape{value};
+        reference::Grid grid = reference::toGrid(shape);
+        auto compare = [&](const char* op, Shape expected, Shape actual)
+                -> std::optional<Mismatch> {
+            if (expected == actual) {
+                return std::nullopt;
+            }
+            return Mismatch{op, shape, expected, actual};
+        };
+
+        constexpr T west = repeat<T>(repeat<T>(3, 2, PART / 2), 2 * PART,
+                                     LAYER);
+        constexpr T top = repeat<T>(3, 2, PART) << (2 * PART * (LAYER - 1));
+        reference::Cells east = reference::fromMask(~west);
+        reference::Cells topCells = reference::fromMask(top);
+
+        std::optional<Mismatch> ret;
+        (ret = compare("supportedPart",
+                Shape(reference::toMask(reference::supportedPart(grid))),
+                Shape(shape.supportedPart())))
+        || (ret = compare("collapse",
+                reference::fromGrid(reference::collapse(grid)),
+                shape.collapse()))
+        || (ret = compare("breakCrystals<east>",
+                reference::fromGrid(reference::breakCrystals(grid, east)),
+                shape.breakCrystals<~west>()))
+        || (ret = compare("breakCrystals<top>",
+                reference::fromGrid(reference::breakCrystals(grid, topCells)),
+                shape.breakCrystals<top>()))
+        || (ret = compare("cut",
+                reference::fromGrid(reference::cut(grid)), shape.cut()))
+        || (ret = compare("pin",
+                reference::fromGrid(reference::pin(grid)), shape.pin()))
+        || (ret = compare("canonical",
+                reference::canonical(shape), shape.canonical()))
+        || (ret = compare("canonicalHalf",
+                reference::canonicalHalf(shape), shape.canonicalHalf()));
+        return ret;
+    }
+
+    size_t numChunks() const {
+        uint64_t total = exhaustive ? end - begin : samples;
+        return (total + chunkSize - 1) / chunkSize;
+    }
+
+    // The values of a chunk. Samples are spread evenly over the number of
+    // non-empty layers, so that the small shapes are not drowned by the
+    // (mostly floating) shapes that fill all the layers.
+    void values(size_t chunk, std::vector<T>& ret) const {
+        ret.clear();
+        if (exhaustive) {
+            uint64_t first = begin + chunk * chunkSize;
+            uint64_t last = std::min(end, first + chunkSize);
+            for (uint64_t v = first; v < last; ++v) {
+                ret.push_back(T(v));
+            }
+            return;
+        }
+        std::mt19937_64 rng{seed * 0x9e3779b97f4a7c15ull + chunk};
+        uint64_t first = chunk * chunkSize;
+        uint64_t last = std::min(samples, first + chunkSize);
+        for (uint64_t i = first; i < last; ++i) {
+            size_t layers = i % LAYER + 1;
+            size_t bits = 2 * PART * layers;
+            T mask = bits >= 8 * sizeof(T) ? ~T(0) : (T(1) << bits) - 1;
+            T value = T(rng());
+            if constexpr (sizeof(T) > sizeof(uint64_t)) {
+                value = value << 64 | rng();
+            }
+            ret.push_back(value & mask);
+        }
+    }
+
+    // The mismatch in the first chunk that has one
+    std::optional<Mismatch> run() const {
+        size_t total = numChunks();
+        std::atomic<size_t> nextChunk = 0;
+        std::atomic<size_t> doneChunks = 0;
+        // chunk of the first mismatch found so far
+        std::atomic<size_t> failedChunk = total;
+        std::optional<Mismatch> found;
+        std::mutex mutex;
+
+        auto worker = [&] {
+            std::vector<T> chunkValues;
+            while (true) {
+                size_t chunk = nextChunk++;
+                if (chunk >= total || chunk > failedChunk) {
+                    return;
+                }
+                values(chunk, chunkValues);
+                for (T value : chunkValues) {
+                    if (auto mismatch = check(value)) {
+                        std::lock_guard lock{mutex};
+                        if (chunk < failedChunk) {
+                            failedChunk = chunk;
+                            found = mismatch;
+                        }
+                        break;
+                    }
+                }
+                ++doneChunks;
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (size_t i = 0; i < threads; ++i) {
+            pool.emplace_back(worker);
+        }
+        auto start = std::chrono::steady_clock::now();
+        while (doneChunks < total && failedChunk == total) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            size_t done = doneChunks;
+            std::cerr << std::format("\rChecked {}/{} chunks in {:.0f}s",
+                    done, total, elapsed.count()) << std::flush;
+        }
+        for (auto& thread : pool) {
+            thread.join();
+        }
+        std::cerr << std::endl;
+        return found;
+    }
+};
+
+// A value in hex, which may not fit in 64 bits
+std::string hex(Shape::T value) {
+    std::string ret;
+    do {
+        ret.insert(ret.begin(), "0123456789abcdef"[value & 15]);
+        value >>= 4;
+    } while (value);
+    return "0x" + ret;
+}
+
+// The two results, and a line marking the cells where they differ
+std::string describe(const Verifier::Mismatch& mismatch) {
+    std::string expected = mismatch.expected.toString();
+    std::string actual = mismatch.actual.toString();
+    std::string marks(expected.size(), ' ');
+    for (size_t i = 0; i < expected.size(); ++i) {
+        if (expected[i] != actual[i]) {
+            marks[i] = '^';
+        }
+    }
+    return std::format("Mismatch in {} for {}\n"
+            "  input:     {}\n"
+            "  reference: {}\n"
+            "  optimized: {}\n"
+            "             {}", mismatch.op, hex(mismatch.input.value),
+            mismatch.input.toString(), expected, actual, marks);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    using namespace Shapez;
+
+    Verifier verifier;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            verifier.threads = std::max(1ul, std::stoul(argv[++i]));
+        } else if (arg == "--range" && i + 2 < argc) {
+            verifier.exhaustive = true;
+            verifier.begin = std::stoull(argv[++i], nullptr, 0);
+            verifier.end = std::stoull(argv[++i], nullptr, 0);
+        } else if (arg == "--samples" && i + 1 < argc) {
+            verifier.exhaustive = false;
+            verifier.samples = std::stoull(argv[++i], nullptr, 0);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            verifier.seed = std::stoull(argv[++i], nullptr, 0);
+        } else {
+            std::cout << "Usage: verify [--threads n] [--range begin end] "
+                "[--samples n] [--seed n]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (verifier.exhaustive) {
+        std::cout << std::format("Checking all the values in [{:#x}, {:#x})",
+                verifier.begin, verifier.end) << std::endl;
+    } else {
+        std::cout << std::format("Checking {} random values, seed {}",
+                verifier.samples, verifier.seed) << std::endl;
+    }
+    if (auto mismatch = verifier.run()) {
+        std::cout << describe(*mismatch) << std::endl;
+        if (std::string_view(mismatch->op) == "supportedPart") {
+            std::cout << "(the supported parts are shown as crystals)"
+                << std::endl;
+        }
+        return 1;
+    }
+    std::cout << "All the operations match the reference" << std::endl;
+    return 0;
+}